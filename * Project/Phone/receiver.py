@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+#Bar Code Reader -> Bluetooth: reference receiver
+#
+#OVERVIEW
+#The phone's side of the bluetooth link, as the firmware (../Source/main.c) expects it: for testing
+#the firmware offline or without a phone, and as the model for the phone's application. It reads the
+#bytes the firmware sends over its serial (SPP) connection, works out the replies, and reports what
+#it received.
+#
+#PROTOCOL
+#Barcodes arrive as frames, several of which may be in flight at once:
+#	0x02, length, sequence number, <length barcode bytes>, crc8 (poly 0x07, init 0, over length,
+#	sequence number and bytes)
+#Each good frame is acknowledged with 0xFF, '$', and its sequence number. The 0xFF only wakes the
+#processor, which sleeps while it waits; it's lost in the wake-up. Acknowledgments are cumulative:
+#the firmware takes one as acknowledging every frame it sent before that one, and only goes back to
+#resend after a round that got no new acknowledgment. So once a frame is bad, nothing behind it is
+#acknowledged (or delivered) until its resend arrives, as the first frame of a round that goes back.
+#A resent frame keeps its sequence number, so a repeat of one already received is acknowledged
+#again but not delivered again.
+#A frame's barcode bytes are packed (see PackBarcode() in main.c): the symbology type (the CS-1504's),
+#a byte of encoding (top 2 bits) and character count (low 6), then the characters:
+#	0x00 ascii	one byte each
+#	0x40 BCD	digits; two per byte, high nibble first, an odd count padded with 0xF
+#	0x80 six-bit	0-9 A-Z a-z - . (values 0-9, 10-35, 36-61, 62, 63); packed msb first, the last
+#			byte zero-padded
+#An "are you awake?" signal is a lone '*', answered with a bare '$'.
+#
+#USAGE
+#	receiver.py decode [-x] FILE - decodes a capture of the bytes the firmware sent (binary, or hex
+#	                               text with -x), printing each barcode and the replies it would send
+#	receiver.py serve PORT       - serves a live serial port (needs pyserial), e.g. a PC's bluetooth
+#	                               serial port, connected to by the module
+
+import sys
+
+FRAME_START = 0x02
+FRAME_OVERHEAD = 4 #Start, length, sequence number, crc
+MAX_FRAME_LENGTH = 20 #MAX_BARCODE_LENGTH; a longer length is no frame's, so no frame starts there
+ACK_PREAMBLE = 0xFF
+ACK_FRAME_START = ord('$')
+RUAWAKE = ord('*')
+ENC_ASCII = 0x00
+ENC_BCD = 0x40
+ENC_SIXBIT = 0x80
+SIXBIT_CHARS = '0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-.'
+RECENT_SEQS = 64 #Sequence numbers remembered, to drop repeats; well over a queue and a window's worth
+
+
+def crc8_update(crc, b):
+	crc ^= b
+	for i in range(8):
+		if crc & 0x80:
+			crc = ((crc << 1) ^ 0x07) & 0xFF
+		else:
+			crc = (crc << 1) & 0xFF
+	return crc
+
+
+def seq_before(a, b):
+	#Sequence numbers wrap at 256; a comes before b if it's less than half way round behind it
+	return a != b and ((b - a) & 0xFF) < 0x80
+
+
+def unpack(payload):
+	#Returns (symbology type, characters); raises ValueError if the bytes don't hold what the
+	#header says
+	payload = bytearray(payload)
+	if len(payload) < 2:
+		raise ValueError('no header')
+	enc = payload[1] & 0xC0
+	n = payload[1] & 0x3F
+	body = payload[2:]
+	if enc == ENC_ASCII:
+		chars = body.decode('latin-1')
+	elif enc == ENC_BCD:
+		digits = []
+		for b in body:
+			digits += [b >> 4, b & 0x0F]
+		if (n & 1) and digits[-1:] == [0x0F]:
+			digits.pop()
+		if any(d > 9 for d in digits):
+			raise ValueError('bad BCD digit')
+		chars = ''.join(str(d) for d in digits)
+	elif enc == ENC_SIXBIT:
+		acc = 0
+		nbits = 0
+		chars = ''
+		for b in body:
+			acc = (acc << 8) | b
+			nbits += 8
+			while nbits >= 6 and len(chars) < n:
+				nbits -= 6
+				chars += SIXBIT_CHARS[(acc >> nbits) & 0x3F]
+	else:
+		raise ValueError('unknown encoding 0x%02X' % enc)
+	if len(chars) != n:
+		raise ValueError('%d characters, not %d' % (len(chars), n))
+	return payload[0], chars
+
+
+class Receiver(object):
+	#feed() takes received bytes and returns the bytes to send back; deliver(seq, payload) is
+	#called once for each new barcode, in order.
+
+	def __init__(self, deliver):
+		self.deliver = deliver
+		self.buf = bytearray()
+		self.recent = [] #Sequence numbers delivered, oldest first
+		self.bad = False #A bad frame is waiting for its resend
+		self.last_seq = None #Of the last thing received, if it was a good frame
+		self.bad_frames = 0
+
+	def feed(self, data):
+		self.buf += bytearray(data)
+		out = bytearray()
+		while self.buf:
+			b = self.buf[0]
+			if b == RUAWAKE:
+				del self.buf[0]
+				out.append(ACK_FRAME_START)
+			elif b != FRAME_START or (len(self.buf) > 1 and self.buf[1] > MAX_FRAME_LENGTH):
+				del self.buf[0] #Not the start of anything (maybe of a frame whose start was lost); resynchronize
+				self.bad = True
+				self.last_seq = None
+			elif len(self.buf) < FRAME_OVERHEAD or len(self.buf) < FRAME_OVERHEAD + self.buf[1]:
+				break #Wait for the rest
+			else:
+				out += self.frame()
+		return bytes(out)
+
+	def frame(self):
+		length = self.buf[1]
+		seq = self.buf[2]
+		payload = bytes(self.buf[3:3 + length])
+		crc = 0
+		for b in self.buf[1:3 + length]:
+			crc = crc8_update(crc, b)
+		if crc != self.buf[3 + length]:
+			#Drop just the start byte; the real next frame may begin inside this one
+			del self.buf[0]
+			self.bad_frames += 1
+			self.bad = True
+			self.last_seq = None
+			return b''
+		del self.buf[:FRAME_OVERHEAD + length]
+		prev_seq = self.last_seq
+		self.last_seq = seq
+
+		ack = bytes(bytearray([ACK_PREAMBLE, ACK_FRAME_START, seq]))
+		if seq in self.recent:
+			return ack
+		if self.bad and not self.is_resend(seq, prev_seq):
+			return b''
+		self.bad = False
+
+		self.recent.append(seq)
+		del self.recent[:-RECENT_SEQS]
+		self.deliver(seq, payload)
+		return ack
+
+	def is_resend(self, seq, prev_seq):
+		#The frame right after the last one delivered is the bad one. Otherwise, a round's frames
+		#come in order, so a good frame that doesn't come after the good one just before it starts
+		#a round; and a round that goes back starts with the oldest unacknowledged frame.
+		if self.recent and seq == ((self.recent[-1] + 1) & 0xFF):
+			return True
+		return prev_seq is not None and not seq_before(prev_seq, seq)
+
+
+def read_capture(path, as_hex):
+	with open(path, 'rb') as f:
+		data = f.read()
+	if as_hex:
+		return bytes(bytearray(int(t, 16) for t in data.decode('ascii').split()))
+	return data
+
+
+def hex_bytes(data):
+	return ' '.join('%02X' % b for b in bytearray(data))
+
+
+def describe(seq, payload):
+	try:
+		symbology, chars = unpack(payload)
+	except ValueError as e:
+		return 'seq 0x%02X: %s (%s)' % (seq, hex_bytes(payload), e)
+	return 'seq 0x%02X: type 0x%02X %s' % (seq, symbology, chars)
+
+
+def main(argv):
+	if len(argv) < 3 or argv[1] not in ('decode', 'serve'):
+		sys.stderr.write('usage: receiver.py decode [-x] FILE | serve PORT\n')
+		return 2
+
+	received = []
+	r = Receiver(lambda seq, payload: received.append((seq, payload)))
+
+	if argv[1] == 'decode':
+		args = [a for a in argv[2:] if a != '-x']
+		reply = r.feed(read_capture(args[0], '-x' in argv[2:]))
+		for seq, payload in received:
+			print(describe(seq, payload))
+		print('reply: %s' % hex_bytes(reply))
+		print('bad frames: %d' % r.bad_frames)
+		return 0
+
+	import serial
+	port = serial.Serial(argv[2], 9600, timeout=0.1)
+	while True:
+		reply = r.feed(port.read(64))
+		if reply:
+			port.write(reply)
+		while received:
+			print(describe(*received.pop(0)))
+			sys.stdout.flush()
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))
@@ -19,11 +19,22 @@
 //a sleep state, where power use is minimized. LED1 provides some feedback; it blinks twice quickly after a barcode
 //has successfully been read from the barcode reader, then once when the system has successfully established a 
 //bluetooth connection with a mobile phone.
+//Barcodes that can't be delivered stay queued in RAM (as room allows) and go out with the next connection. 
+//Several barcodes may be in flight over one connection; each is framed as: 
+//	0x02, length, sequence number, <length barcode bytes>, crc8 (poly 0x07, over length, sequence number and bytes)
+//where the barcode bytes are packed as they are in the queue: the symbology type, then the encoding and
+//character count, then the characters as BCD, six-bit or ascii (see PackBarcode()), for the phone to unpack.
+//The phone acknowledges each frame it receives in order with 0xFF, '$', and the frame's sequence number. 
+//(The 0xFF lets the processor sleep while it waits: the byte's falling start bit wakes it, and the byte itself 
+//is lost in the wake-up.) Acknowledgments are cumulative. A frame that is retransmitted keeps its sequence number, so the phone
+//can drop duplicates. Phone/receiver.py is the phone's side of this protocol, unpacking included, for reference and 
+//offline testing.
 //To check whether or not the system is connecting with a mobile phone properly, tap the barcode reader's button
 //quickly, and an "are you awake?" signal is sent over bluetooth to the mobile phone. (The phone's corresponding 
-//application has been designed to make an "I am awake!" noise.) 
+//application has been designed to make an "I am awake!" noise.) Tapping the button twice quickly delivers any
+//queued barcodes, without waking the barcode reader.
 //
-//The application has three special modes, activated by holding the dedicated circuit's Button1 and reset button 
+//The application has four special modes, activated by holding the dedicated circuit's Button1 and reset button 
 //down, then releasing the reset button:
 //1)  GET BLUETOOTH ADDRESS MODE: If, upon releasing the reset button, button1 is held down until the dedicated circuit's 
 //LED1 blinks once and is then released, the application enters "obtaining mobile phone bluetooth address" mode. LED1 
@@ -38,14 +49,20 @@
 //automatically resets the bluetooth module and barcode reader to factory defaults and then makes a few necessary
 //customizations (The bluetooth module is named "BarCodeKey", the bluetooth module's encryption of serial data is turned off,
 //the barcode reader's "connect to host" and "disconnect from host" beeps are turned off, and the barcode reader's ability
-//to manually toggle sound on and off is rendered inaccessible). Upon successful completion, the mode blinks 3 times slowly; 
-//upon unsuccessful completion, it blinks 6 times quickly.
+//to manually toggle sound on and off is rendered inaccessible). The bluetooth module is also switched to 19200bps, and 
+//the rate it actually answers at is found and stored; the internal oscillator is trimmed (osctune) against the barcode 
+//reader's replies, and the trim is stored too. The mode first reads back what it can (the bluetooth module's settings, 
+//the stored baud rate and trim, and a record of the barcode reader defaults last applied) and only writes what differs, 
+//so running it on a configured unit changes nothing; if that fails, it falls back to the full reset described above. 
+//Upon successful completion, the mode blinks 3 times slowly; upon unsuccessful completion, it blinks 6 times quickly.
 //
 //3)  BLUETOOTH CONSOLE MODE: If, upon releasing the reset button, Button1 is held down until the dedicated circuit's LED1 
-//blinks three times, the application enters Bluetooth Console Mode. In this mode, bluetooth module commands can be 
+//blinks three times and is then released, the application enters Bluetooth Console Mode. In this mode, bluetooth module commands can be 
 //entered from a connected PC's terminal window and carried out by pressing return. (A7 EB101 BLuetooth commands are outlined 
 //in the EB101 protocol document.) Upon entry into the mode, a "PC:" command-line prompt should appear in the window; if it
 //doesn't press return a few times. Bluetooth Console Mode can be exited by typing "out<CR>", or pressing the reset button. 
+//Two commands are the console's own: "cap<CR>" arms a trace of the bytes of the next delivery sessions, and "dump<CR>" 
+//prints it (see Session Trace). 
 //For bluetooth console mode, the PC rs232 serial terminal window settings should be 9600bps, 1 stop bit, odd-parity, 
 //no flow control. While the bluetooth module is set up for *no* parity, the PC is talking to it via a microprocessor that 
 //gets configured for odd parity while talking on its wired (i.e. bar code reader or PC) channel. Bluetooth console mode 
@@ -55,6 +72,13 @@
 //since in PC-UC communications, the PC is the host. In other permutations of the three-way connection, no swap is necessary
 //since the UP is either the rs232 host, or it is not connected. 
 //
+//4)  SELF BENCHMARK MODE: If, upon releasing the reset button, Button1 is held down until the dedicated circuit's LED1 
+//blinks four times quickly, the application measures the unit (timer0 against the serial bit clock, EEPROM read and 
+//write times, serial echo on each channel, the barcode reader's wake-up to reply and data ready, and the bluetooth 
+//connection time) and prints a table of the results to the PC, set up as for Bluetooth Console Mode. The barcode reader 
+//is measured first, with the jumpers connecting UC to BCR; LED1 then lights until Button1 is pressed, so the RX and TX 
+//jumpers can be moved over to PC. See SelfBenchmark() for what each row means.
+//
 //In order to verify that the barcode reader is functioning properly, all 4 three-way jumpers should connect between PC and 
 //BCR. The PC-based shareware application "HDS1504.exe" "Host Driver" can be used to connect to the barcode reader and verify its 
 //functionality.
@@ -93,6 +117,7 @@ typedef enum {
 	STATE_GETTING_BARCODE_FROM_READER,
 	STATE_SENDING_BARCODE_OVER_BLUETOOTH,
 	STATE_SENDING_RUAWAKE_OVER_BLUETOOTH,
+	STATE_BENCHMARK,
 } STATE_T; 
 //--------------------------------------------
 
@@ -104,6 +129,7 @@ typedef enum {
 	DONE_TIMED_OUT,
 	DONE_SUCCESS,
 	DONE_FAILURE,
+	DONE_RX_ERROR, //A received byte failed its parity or framing check
 } DONE_T; 
 //--------------------------------------------
 
@@ -116,26 +142,140 @@ typedef enum {
 	BC_NOT_VALID_LENGTH_TOO_LONG,
 	BC_NOT_VALID_TYPE,
 	BC_NOT_VALID_CHARACTERS,
+	BC_NOT_VALID_CHECK_DIGIT,
+	BC_NOT_ALLOWED_TYPE, //Valid, but filtered out by the symbology allow-list
+	BC_NOT_VALID_INCOMPLETE, //Good so far, but its last byte hasn't arrived (and been checked)
 } BC_VALIDITY_T; 
 //--------------------------------------------
 
 
-//Buffers and String Constants
+//RAM Layout
 //+++++++++++++++++++++++++++++++++++++++++++++
-#define RX_BUFF_LENGTH 40
-unsigned char rx_buff[RX_BUFF_LENGTH];
+//0x70-0x7F is common RAM: the same 16 bytes in every bank, reached without bank select instructions.
+//It holds the clock and flags the ISR shares with the polling loops (ms_delay(), IntervalOver(), 
+//ListenForResponse(), ButtonEvent()), so neither side pays for a bank switch. 0x70-0x73 are left to 
+//the compiler, for the ISR's context save. These variables can't be initialized where they're 
+//declared; InitTimer0() and InitializeEverything() do it. Not all ISR-shared state fits: the two 
+//button records (bcr_btn, btn1; 11 bytes each) are placed by the compiler like everything else, and
+//the ISR selects their bank. The arena, the one large buffer, fills bank 1's general purpose RAM 
+//exactly (an array can't straddle banks); it's reached through the FSR with IRP clear.
+#define TIMER0_ISR_COUNT_ADDR 0x74 //2 bytes
+#define COARSE_MS_ADDR 0x76 //2 bytes
+#define COARSE_S_ADDR 0x78 //2 bytes
+#define ISR_TICKS_PER_MS_ADDR 0x7A
+#define ISR_MS_PER_TICK_ADDR 0x7B
+#define ISR_SUB_TICK_ADDR 0x7C
+#define QUERY_BCR_F_ADDR 0x7D
+#define BC_CHECK_ON_ADDR 0x7E
+//0x7F is spare
+#define ARENA_ADDR 0xA0 //Bank 1, 0xA0-0xEF
+#define BANK_GPR_LENGTH 80
+//--------------------------------------------
 
-#define BARCODE_BUFF_LENGTH 20
-unsigned char barcode_buff[BARCODE_BUFF_LENGTH];
 
-#define MAX_STR_BUFF_LENGTH 25
-unsigned char str_buff[MAX_STR_BUFF_LENGTH];
+//Buffers and String Constants
+//+++++++++++++++++++++++++++++++++++++++++++++
+//rx_buff and bc_queue are fixed partitions of a single RAM arena. The rx partition is
+//phase-scoped: while a barcode is held, the record stays where the reader's upload response
+//put it, and the rx window shrinks to the bytes in front of it (see ArenaHoldBarcode()).
+#define RX_BUFF_LENGTH 40
+#define BC_QUEUE_LENGTH 40
+#define STR_BUFF_LENGTH 3 //Enough for b2str_buff()
+#define MAX_STR_BUFF_LENGTH 25 //Longest string WriteStr()/strlen() will scan
+
+#define ARENA_RX_OFFSET 0
+#define ARENA_QUEUE_OFFSET (ARENA_RX_OFFSET+RX_BUFF_LENGTH)
+#define ARENA_LENGTH (ARENA_QUEUE_OFFSET+BC_QUEUE_LENGTH) //No more than BANK_GPR_LENGTH
+#if ARENA_LENGTH > BANK_GPR_LENGTH
+#error "The arena (ARENA_LENGTH) doesn't fit in bank 1"
+#endif
+unsigned char arena[ARENA_LENGTH] @ARENA_ADDR;
+
+#define rx_buff (arena+ARENA_RX_OFFSET)
+#define bc_queue (arena+ARENA_QUEUE_OFFSET)
+unsigned char str_buff[STR_BUFF_LENGTH];
+unsigned char rx_buff_length = RX_BUFF_LENGTH; //Size of the rx window for the current phase
+
+//A barcode record, as an (offset, length) view into the arena, plus the sequence number it is 
+//delivered under. length==0 means none is held.
+typedef struct {
+	unsigned char offset;
+	unsigned char length;
+	unsigned char seq;
+} bc_view;
+bc_view barcode_view;
+
+//Queued records are packed back to back: length, sequence number, chars
+#define BC_RECORD_LENGTH_I 0
+#define BC_RECORD_SEQ_I 1
+#define BC_RECORD_HEADER_LENGTH 2
+unsigned char bc_queue_used = 0; //Bytes of the queue in use
+unsigned char tx_seq = 0; //Sequence number for the next record
 
 #define BT_ADDRESS_LENGTH 17
-//Bluetooth address bytes are held at the base of EEPROM memory
+//Bluetooth address bytes are held at the base of EEPROM memory. That's the first of NUM_BT_PEERS 
+//peer slots (each an address and its '\0'); the others follow the settings below.
+#define NUM_BT_PEERS 3
+#define BT_PEER_SLOT_LENGTH (BT_ADDRESS_LENGTH+1)
+#define EEPROM_PEER_1_POS 24
+//"lst trusted" replies "ACK\r", then each trusted address and a '\r', then '>'. Learning reads it
+//with the whole arena as its rx window.
+#define BT_LST_FIRST_I 4
+#define BT_LST_ENTRY_LENGTH (BT_ADDRESS_LENGTH+1)
+#define BT_LST_REPLY_LENGTH (BT_LST_FIRST_I+NUM_BT_PEERS*BT_LST_ENTRY_LENGTH+1)
+#if BT_LST_REPLY_LENGTH > ARENA_LENGTH-ARENA_RX_OFFSET
+#error "\"lst trusted\" with NUM_BT_PEERS entries doesn't fit the arena"
+#endif
+//The list as it stood before the pairing window is kept just past the reply: a mask of the entries 
+//that held an address, then each one's hash (DupHash()). The phone learned is the one that's new.
+#define BT_LST_SNAPSHOT_I BT_LST_REPLY_LENGTH
+#define BT_LST_SNAPSHOT_LENGTH (1+2*NUM_BT_PEERS)
+#if BT_LST_SNAPSHOT_I+BT_LST_SNAPSHOT_LENGTH > ARENA_LENGTH-ARENA_RX_OFFSET
+#error "The \"lst trusted\" snapshot doesn't fit the arena"
+#endif
+
+//Serial calibration results are held just past the address (and its '\0'). 0xFF (erased) means
+//not calibrated.
+#define EEPROM_BT_BAUD_POS 18
+#define EEPROM_OSCTUNE_POS 19
+#define EEPROM_NOT_SET 0xFF
+
+//Symbology allow-list: one bit per CS-1504 type byte (types 0-7, then 8-15). A type whose bit is 
+//clear is dropped before it's queued. Erased (0xFF 0xFF) allows everything.
+#define EEPROM_SYMBOLOGY_ALLOW_POS 20
+#define SYMBOLOGY_ALLOW_LENGTH 2
+
+//Seconds a scan is remembered, so a repeat of it can be dropped; 0 turns this off
+#define EEPROM_DUP_TTL_POS 22
+
+//Order the peers are tried in, most recent successful connection first: 2 bits per slot number, 
+//first in the low bits. Erased means slot order.
+#define EEPROM_PEER_ORDER_POS 23
+#define PEER_ORDER_DEFAULT 0xE4 //0,1,2,(3)
+
+//Version of the barcode reader defaults (CMD_BCR_RESTORE_DEFAULTS, CMD_BCR_CUSTOMIZE_DEFAULTS) last 
+//applied to the reader. Bump BCR_DEFAULTS_VERSION when they change.
+#define EEPROM_BCR_DEFAULTS_POS (EEPROM_PEER_1_POS+(NUM_BT_PEERS-1)*BT_PEER_SLOT_LENGTH)
+#define BCR_DEFAULTS_VERSION 0x01
+
+//Spare byte the self benchmark rewrites (with its own value) to time EEPROM writes
+#define EEPROM_BENCH_SCRATCH_POS (EEPROM_BCR_DEFAULTS_POS+1)
+
+//Session trace (see Session Trace): its state, its length, and the rest of EEPROM for the trace itself
+#define EEPROM_TRACE_STATE_POS (EEPROM_BENCH_SCRATCH_POS+1)
+#define EEPROM_TRACE_LENGTH_POS (EEPROM_TRACE_STATE_POS+1)
+#define EEPROM_TRACE_POS (EEPROM_TRACE_LENGTH_POS+1)
+#define EEPROM_TRACE_LENGTH (256-EEPROM_TRACE_POS)
 
 const unsigned char dashes_s[] = "\n\r-\n\r";
 const unsigned char ack_s[] = "ACK\r>"; //Most of the time, we're only looking for the first three chars
+
+#define BT_FRAME_START 0x02
+#define BT_FRAME_OVERHEAD 4 //Start, length, sequence number, crc
+#define BT_ACK_PREAMBLE 0xFF
+#define BT_ACK_FRAME_START '$'
+#define BT_ACK_FRAME_LENGTH 3 //Preamble, '$', sequence number
+#define BT_ACK_REPLY_SPAN MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY //A window's acknowledgments come as the phone gets each frame
 //--------------------------------------------
 
 
@@ -147,13 +287,31 @@ const unsigned char ack_s[] = "ACK\r>"; //Most of the time, we're only looking f
 
 typedef struct {
 	unsigned short start_tick;
-	unsigned short end_tick;
-	unsigned char will_wrap; 
+	unsigned short wait;
 } interval;
-unsigned short timer0_isr_count=0; 
-
+unsigned short timer0_isr_count @TIMER0_ISR_COUNT_ADDR; 
+
+//Coarse seconds, for things (like the duplicate-scan cache) that have to age across sleeps. 
+//Timer0 advances it while awake; WDT slices advance it while asleep.
+unsigned short coarse_s @COARSE_S_ADDR;
+unsigned short coarse_ms @COARSE_MS_ADDR;
+
+//Waiting
+//timer0_isr_count is the clock; anything may read it. Every loop that waits (on time, or on a flag the
+//hardware sets by itself) goes round through WaitIdle(), or WAIT_SPIN() where a call would be too deep
+//(the EEPROM waits run under TraceService(), inside WaitIdle()), and every deadline it waits on is
+//tested with IntervalOver() or TickOver(). A modelled clock (a host build on virtual time) would go in
+//behind those.
+#define WAIT_SPIN() clear_wdt()
+
+#define BT_TRUSTED_POLL_GAP 512 //First gap between polls while learning; grows to BT_TRUSTED_MAX_POLL_GAP
+#define BT_TRUSTED_MAX_POLL_GAP 2048
+#define BT_LEARN_WINDOW 40000 //How long to wait for a phone to pair
 #define SERIAL_SELECT_DELAY (30)
 #define SECONDARY_POWER_DELAY (30)
+#define BT_MODE_SWITCH_DELAY 20 //For the EB101 to follow pin 2 into or out of command mode
+#define BCR_DATA_BLINK_MS 100 //Blinks: the reader has data; a connection was made
+#define BT_CON_BLINK_MS 50
 
 #define BCR_BUTTON_RELEASE_TO_BCR_WAKEUP_DELAY 3000  //Could be tuned?
 #define BCR_WAKEUP_TO_INTERROGATE_DELAY 230  //Could be tuned?
@@ -164,58 +322,348 @@ unsigned short timer0_isr_count=0;
 #define MAX_BCR_INTER_CHAR_RESPONSE_DELAY 400
 #define MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY 1500
 
+//Clock Governor
+//The system runs at 8MHz while awake, and drops to 31kHz for long delays. Timer0 overflows every 
+//256 instruction cycles: 8 times a ms at 8MHz, once every ~33ms at 31kHz. The ISR scales these so
+//timer0_isr_count always counts (roughly) ms. (The OPTION prescaler stays with the WDT, for its ~34 sec.)
+typedef enum {
+	CLK_IDLE=0, //31kHz
+	CLK_ACTIVE, //8MHz
+} CLK_T;
+#define NUM_CLKS 2
+rom char * clk_ircf = {0x00, 0x70}; //IRCF bits of osccon
+rom char * clk_ticks_per_ms = {1, 8};
+#define CLK_IDLE_MS_PER_TICK 33
+rom char * clk_ms_per_tick = {CLK_IDLE_MS_PER_TICK, 1};
+#define CLOCK_IDLE_MIN_DELAY 100 //Delays at least this long run at CLK_IDLE
+
+//Baud Profiles
+//Each channel has its own baud rate, applied whenever the mux selects it. BRG values are per
+//clock, with BRGH=1 and BRG16=1: baud = Fosc/(4*(spbrg+1)). There's no usable rate at CLK_IDLE.
+typedef enum {
+	BAUD_9600=0,
+	BAUD_19200,
+} BAUD_T;
+#define NUM_BAUDS 2
+rom char * brg_table = {
+	0, 0, 		//CLK_IDLE
+	207, 103 	//CLK_ACTIVE
+};
+rom char * bt_baud_candidates = {BAUD_19200, BAUD_9600}; //Fastest first
+#define OSCTUNE_MIN_TRIM (-8)
+#define OSCTUNE_MAX_TRIM 7
+
 #define NUM_BT_CMD_TRIES 4
 #define NUM_BCR_CMD_TRIES 4
-#define NUM_BT_SEND_TRIES 6
+#define NUM_BT_SEND_TRIES 6 //Rounds in a row without an acknowledgment before giving up
+#define NUM_BT_CON_TRIES 4 //Per peer
+
+//Retry backoff, in ms (powers of 2), and the radio-on budget of one delivery session
+#define RETRY_BT_BACKOFF 64
+#define RETRY_BT_MAX_BACKOFF 512
+#define BT_SESSION_BUDGET 8500 //Keeps a delivery state inside WDT_BUDGET_MS
+#define BT_SEND_WINDOW 4 //Frames in flight
 //--------------------------------------------
 
 
 //Command/Response Info
 //+++++++++++++++++++++++++++++++++++++++++++++
+//All fixed commands and the responses they are checked against live in two program memory
+//pools: one of ascii text for the bluetooth module, one of binary packets for the barcode reader.
+
+//Bluetooth module pool
+#define BT_CR_LENGTH 1
+#define BT_PROMPT_LENGTH 1
+#define BT_ACK_LENGTH 5 //Most of the time, we're only looking for the first three chars
+#define BT_ACK_CHECK_LENGTH 3
+#define BT_RST_FACTORY_CMD_LENGTH 12
+#define BT_SET_NAME_CMD_LENGTH 20
+#define BT_SET_ENCRYPT_CMD_LENGTH 16
+#define BT_SET_TXPOWER_CMD_LENGTH 15
+#define BT_RET_CMD_LENGTH 4
+#define BT_DIS_CMD_LENGTH 4
+#define BT_LST_TRUSTED_CMD_LENGTH 12
+#define BT_SET_BAUD_CMD_LENGTH 15
+#define BT_GET_NAME_CMD_LENGTH 9
+#define BT_GET_ENCRYPT_CMD_LENGTH 12
+#define BT_GET_TXPOWER_CMD_LENGTH 12
+
+#define BT_CR_P 0
+#define BT_PROMPT_P (BT_CR_P+BT_CR_LENGTH)
+#define BT_ACK_P (BT_PROMPT_P+BT_PROMPT_LENGTH)
+#define BT_RST_FACTORY_CMD_P (BT_ACK_P+BT_ACK_LENGTH)
+#define BT_SET_NAME_CMD_P (BT_RST_FACTORY_CMD_P+BT_RST_FACTORY_CMD_LENGTH)
+#define BT_SET_ENCRYPT_CMD_P (BT_SET_NAME_CMD_P+BT_SET_NAME_CMD_LENGTH)
+#define BT_SET_TXPOWER_CMD_P (BT_SET_ENCRYPT_CMD_P+BT_SET_ENCRYPT_CMD_LENGTH)
+#define BT_RET_CMD_P (BT_SET_TXPOWER_CMD_P+BT_SET_TXPOWER_CMD_LENGTH)
+#define BT_DIS_CMD_P (BT_RET_CMD_P+BT_RET_CMD_LENGTH)
+#define BT_LST_TRUSTED_CMD_P (BT_DIS_CMD_P+BT_DIS_CMD_LENGTH)
+#define BT_SET_BAUD_CMD_P (BT_LST_TRUSTED_CMD_P+BT_LST_TRUSTED_CMD_LENGTH)
+#define BT_GET_NAME_CMD_P (BT_SET_BAUD_CMD_P+BT_SET_BAUD_CMD_LENGTH)
+#define BT_GET_ENCRYPT_CMD_P (BT_GET_NAME_CMD_P+BT_GET_NAME_CMD_LENGTH)
+#define BT_GET_TXPOWER_CMD_P (BT_GET_ENCRYPT_CMD_P+BT_GET_ENCRYPT_CMD_LENGTH)
+//The desired values, as they appear in the set commands
+#define BT_NAME_VALUE_P (BT_SET_NAME_CMD_P+9)
+#define BT_NAME_VALUE_LENGTH 10
+#define BT_ENCRYPT_VALUE_P (BT_SET_ENCRYPT_CMD_P+12)
+#define BT_ENCRYPT_VALUE_LENGTH 3
+#define BT_TXPOWER_VALUE_P (BT_SET_TXPOWER_CMD_P+12)
+#define BT_TXPOWER_VALUE_LENGTH 2
+
+rom char * bt_pool = 	"\r"
+						">"
+						"ACK\r>"
+						"rst factory\r"
+						"set name BarCodeKey\r"
+						"set encrypt off\r"
+						"set txpower 10\r"
+						"ret\r"
+						"dis\r"
+						"lst trusted\r"
+						"set baud 19200\r"
+						"get name\r"
+						"get encrypt\r"
+						"get txpower\r";
+
+//Barcode reader pool
 #define BCR_INTERROGATE_CMD_LENGTH	5
-const unsigned char bcr_interrogate_cmd[] = {0x01, 0x02, 0x00, 0x9F, 0xDE};
 #define BCR_INTERROGATE_RESPONSE_LENGTH 23
 #define BCR_INTERROGATE_RESPONSE_START_LENGTH 2
-const unsigned char bcr_interrogate_response_start[] = {0x06,0x02};
-
 #define BCR_UPLOAD_CMD_LENGTH 5
-const unsigned char bcr_upload_cmd[] = {0x07, 0x02, 0x00, 0x9E, 0x3E};
 #define BCR_UPLOAD_RESPONSE_START_LENGTH 2
 #define BCR_UPLOAD_RESPONSE_MINIMUM_LENGTH 14
-const unsigned char * bcr_upload_response_start = bcr_interrogate_response_start;
-
 #define BCR_CLEAR_BARCODES_CMD_LENGTH 5
-const unsigned char bcr_clear_barcodes_cmd[] = {0x02, 0x02, 0x00, 0x9F, 0x2E};
 #define BCR_CLEAR_BARCODES_RESPONSE_LENGTH 5
-const unsigned char bcr_clear_barcodes_response[] = {0x06, 0x02, 0x00, 0x5E, 0x6F};
-
 #define BCR_POWER_DOWN_CMD_LENGTH 5
-const unsigned char bcr_power_down_cmd[] = {0x05, 0x02, 0x00, 0x5E, 0x9F};
-#define BCR_POWER_DOWN_RESPONSE_LENGTH 5
-const unsigned char * bcr_power_down_response = bcr_clear_barcodes_response; 
-
 #define BCR_RESTORE_DEFAULTS_CMD_LENGTH 7
-const unsigned char bcr_restore_defaults_cmd[] = {0x04, 0x02, 0x01, 0x01, 0x00, 0xD7, 0x7B};
 #define BCR_RESTORE_DEFAULTS_RESPONSE_LENGTH 8
-const unsigned char bcr_restore_defaults_response[] = {0x06, 0x02, 0x02, 0x01, 0x01, 0x00, 0xAA, 0xD7};
-
 #define BCR_CUSTOMIZE_DEFAULTS_CMD_LENGTH 14
-const unsigned char bcr_customize_defaults_cmd[] = {0x03, 0x02, 0x02, 0x0A, 0x00, 0x02, 0x0B, 0x00, 0x02, 0x55, 0x00, 0x00, 0x38, 0x78};
 #define BCR_CUSTOMIZE_DEFAULTS_RESPONSE_LENGTH 14
-const unsigned char bcr_customize_defaults_response[] = {0x06, 0x02, 0x02, 0x0A, 0x01, 0x02, 0x0B, 0x01, 0x02, 0x55, 0x01, 0x00, 0xA8, 0x89};
 
-#define MAX_BARCODE_LENGTH 20
+#define BCR_INTERROGATE_CMD_P 0
+#define BCR_UPLOAD_CMD_P (BCR_INTERROGATE_CMD_P+BCR_INTERROGATE_CMD_LENGTH)
+#define BCR_CLEAR_BARCODES_CMD_P (BCR_UPLOAD_CMD_P+BCR_UPLOAD_CMD_LENGTH)
+#define BCR_POWER_DOWN_CMD_P (BCR_CLEAR_BARCODES_CMD_P+BCR_CLEAR_BARCODES_CMD_LENGTH)
+#define BCR_RESTORE_DEFAULTS_CMD_P (BCR_POWER_DOWN_CMD_P+BCR_POWER_DOWN_CMD_LENGTH)
+#define BCR_CUSTOMIZE_DEFAULTS_CMD_P (BCR_RESTORE_DEFAULTS_CMD_P+BCR_RESTORE_DEFAULTS_CMD_LENGTH)
+#define BCR_CLEAR_BARCODES_RESPONSE_P (BCR_CUSTOMIZE_DEFAULTS_CMD_P+BCR_CUSTOMIZE_DEFAULTS_CMD_LENGTH)
+#define BCR_RESTORE_DEFAULTS_RESPONSE_P (BCR_CLEAR_BARCODES_RESPONSE_P+BCR_CLEAR_BARCODES_RESPONSE_LENGTH)
+#define BCR_CUSTOMIZE_DEFAULTS_RESPONSE_P (BCR_RESTORE_DEFAULTS_RESPONSE_P+BCR_RESTORE_DEFAULTS_RESPONSE_LENGTH)
+//Interrogate and upload responses start the same way the clear response does
+#define BCR_RESPONSE_START_P BCR_CLEAR_BARCODES_RESPONSE_P
+
+rom char * bcr_pool = {
+	0x01, 0x02, 0x00, 0x9F, 0xDE, //Interrogate
+	0x07, 0x02, 0x00, 0x9E, 0x3E, //Upload
+	0x02, 0x02, 0x00, 0x9F, 0x2E, //Clear barcodes
+	0x05, 0x02, 0x00, 0x5E, 0x9F, //Power down
+	0x04, 0x02, 0x01, 0x01, 0x00, 0xD7, 0x7B, //Restore defaults
+	0x03, 0x02, 0x02, 0x0A, 0x00, 0x02, 0x0B, 0x00, 0x02, 0x55, 0x00, 0x00, 0x38, 0x78, //Customize defaults
+	0x06, 0x02, 0x00, 0x5E, 0x6F, //Clear barcodes response
+	0x06, 0x02, 0x02, 0x01, 0x01, 0x00, 0xAA, 0xD7, //Restore defaults response
+	0x06, 0x02, 0x02, 0x0A, 0x01, 0x02, 0x0B, 0x01, 0x02, 0x55, 0x01, 0x00, 0xA8, 0x89 //Customize defaults response
+};
+
+#define MAX_BARCODE_LENGTH 20 //Of a packed record
+#define MAX_BARCODE_CHARS (MAX_BARCODE_LENGTH-2) //Longer barcodes are rejected (BC_NOT_VALID_LENGTH_TOO_LONG)
 #define FIRST_BARCODE_START_I 12
 #define FIRST_BARCODE_TYPE_I 11
 #define FIRST_BARCODE_STRLEN_I 10
 //--------------------------------------------
 
 
+//Command Table
+//+++++++++++++++++++++++++++++++++++++++++++++
+//Each fixed command is one record in program memory, executed by RunCommand(). Fields:
+//flags, payload position, payload length, check position, check length, expected response 
+//length, number of tries, and the (inter-character) timeout in units of 10ms. Payload and check
+//are positions in bcr_pool if CMD_F_BCR is set, in bt_pool otherwise. check_len/expected response
+//length mean the same thing they do for Send().
+#define CMD_F_BCR 0x01 		//Payload and check are in the barcode reader pool
+#define CMD_F_NO_REPLY 0x02 //Fire-and-forget; send once, don't wait for a reply
+#define CMD_F_UNCOUNTED 0x04 //RunSequence() doesn't count this command's result
+#define CMD_F_OR_NEXT 0x08 	//In a sequence: on success skip the next command, on failure run it instead
+#define CMD_F_BARCODE 0x10 	//The reply carries barcodes; validate them as they arrive
+#define CMD_F_CHECK_ANYWHERE 0x20 //The check may appear anywhere in the reply, not just at its start
+#define CMD_F_NO_BUDGET 0x40 //Tried even once the session's budget is spent (it ends the session)
+
+#define CMD_RECORD_LENGTH 8
+#define CMD_FLAGS_I 0
+#define CMD_PAYLOAD_P_I 1
+#define CMD_PAYLOAD_LENGTH_I 2
+#define CMD_CHECK_P_I 3
+#define CMD_CHECK_LENGTH_I 4
+#define CMD_EXPECTED_LENGTH_I 5
+#define CMD_TRIES_I 6
+#define CMD_TIMEOUT_I 7
+
+#define BT_CMD_TIMEOUT (MAX_BT_INTER_CHAR_RESPONSE_DELAY/10)
+#define BCR_CMD_TIMEOUT (MAX_BCR_INTER_CHAR_RESPONSE_DELAY/10)
+
+typedef enum {
+	CMD_BT_PROMPT=0,
+	CMD_BT_PROMPT_ACK,
+	CMD_BT_RST_FACTORY,
+	CMD_BT_SET_NAME,
+	CMD_BT_SET_ENCRYPT,
+	CMD_BT_SET_TXPOWER,
+	CMD_BT_RET,
+	CMD_BT_DIS,
+	CMD_BT_LST_TRUSTED,
+	CMD_BCR_INTERROGATE,
+	CMD_BCR_UPLOAD,
+	CMD_BCR_CLEAR_BARCODES,
+	CMD_BCR_POWER_DOWN,
+	CMD_BCR_RESTORE_DEFAULTS,
+	CMD_BCR_CUSTOMIZE_DEFAULTS,
+	CMD_BT_SET_BAUD,
+	CMD_BT_PROMPT_ONCE,
+	CMD_BCR_PING,
+	CMD_BT_GET_NAME,
+	CMD_BT_GET_ENCRYPT,
+	CMD_BT_GET_TXPOWER,
+} CMD_T;
+
+rom char * cmd_table = {
+	//CMD_BT_PROMPT - expected length isn't given because we could receive ">" or ">NACK"
+	0, BT_CR_P, BT_CR_LENGTH, BT_PROMPT_P, BT_PROMPT_LENGTH, 0, NUM_BT_CMD_TRIES, BT_CMD_TIMEOUT,
+	//CMD_BT_PROMPT_ACK - right after a reset we may get an ACK rather than a bare prompt
+	CMD_F_OR_NEXT, BT_CR_P, BT_CR_LENGTH, BT_ACK_P, BT_ACK_CHECK_LENGTH, 0, NUM_BT_CMD_TRIES, BT_CMD_TIMEOUT,
+	//CMD_BT_RST_FACTORY
+	CMD_F_NO_REPLY|CMD_F_UNCOUNTED, BT_RST_FACTORY_CMD_P, BT_RST_FACTORY_CMD_LENGTH, 0, 0, 0, 1, 0,
+	//CMD_BT_SET_NAME
+	0, BT_SET_NAME_CMD_P, BT_SET_NAME_CMD_LENGTH, BT_ACK_P, BT_ACK_CHECK_LENGTH, 0, NUM_BT_CMD_TRIES, BT_CMD_TIMEOUT,
+	//CMD_BT_SET_ENCRYPT
+	0, BT_SET_ENCRYPT_CMD_P, BT_SET_ENCRYPT_CMD_LENGTH, BT_ACK_P, BT_ACK_CHECK_LENGTH, 0, NUM_BT_CMD_TRIES, BT_CMD_TIMEOUT,
+	//CMD_BT_SET_TXPOWER
+	0, BT_SET_TXPOWER_CMD_P, BT_SET_TXPOWER_CMD_LENGTH, BT_ACK_P, BT_ACK_CHECK_LENGTH, 0, NUM_BT_CMD_TRIES, BT_CMD_TIMEOUT,
+	//CMD_BT_RET - only the first three chars; we're probably not returning to an existing connection
+	0, BT_RET_CMD_P, BT_RET_CMD_LENGTH, BT_ACK_P, BT_ACK_CHECK_LENGTH, 0, NUM_BT_CMD_TRIES, BT_CMD_TIMEOUT,
+	//CMD_BT_DIS
+	CMD_F_NO_BUDGET, BT_DIS_CMD_P, BT_DIS_CMD_LENGTH, BT_ACK_P, BT_ACK_CHECK_LENGTH, 0, NUM_BT_CMD_TRIES, BT_CMD_TIMEOUT,
+	//CMD_BT_LST_TRUSTED - polled, so a single try
+	0, BT_LST_TRUSTED_CMD_P, BT_LST_TRUSTED_CMD_LENGTH, BT_ACK_P, BT_ACK_CHECK_LENGTH, 0, 1, BT_CMD_TIMEOUT,
+	//CMD_BCR_INTERROGATE
+	CMD_F_BCR, BCR_INTERROGATE_CMD_P, BCR_INTERROGATE_CMD_LENGTH, BCR_RESPONSE_START_P, BCR_INTERROGATE_RESPONSE_START_LENGTH, 
+		BCR_INTERROGATE_RESPONSE_LENGTH, NUM_BCR_CMD_TRIES, BCR_CMD_TIMEOUT,
+	//CMD_BCR_UPLOAD - response length depends on the barcode(s)
+	CMD_F_BCR|CMD_F_BARCODE, BCR_UPLOAD_CMD_P, BCR_UPLOAD_CMD_LENGTH, BCR_RESPONSE_START_P, BCR_UPLOAD_RESPONSE_START_LENGTH, 
+		0, NUM_BCR_CMD_TRIES, BCR_CMD_TIMEOUT,
+	//CMD_BCR_CLEAR_BARCODES
+	CMD_F_BCR, BCR_CLEAR_BARCODES_CMD_P, BCR_CLEAR_BARCODES_CMD_LENGTH, BCR_CLEAR_BARCODES_RESPONSE_P, BCR_CLEAR_BARCODES_RESPONSE_LENGTH, 
+		BCR_CLEAR_BARCODES_RESPONSE_LENGTH, NUM_BCR_CMD_TRIES, BCR_CMD_TIMEOUT,
+	//CMD_BCR_POWER_DOWN - the reply never matched the documented one, though the reader powers down fine; don't wait for it
+	CMD_F_BCR|CMD_F_NO_REPLY|CMD_F_UNCOUNTED, BCR_POWER_DOWN_CMD_P, BCR_POWER_DOWN_CMD_LENGTH, 0, 0, 0, 1, 0,
+	//CMD_BCR_RESTORE_DEFAULTS
+	CMD_F_BCR, BCR_RESTORE_DEFAULTS_CMD_P, BCR_RESTORE_DEFAULTS_CMD_LENGTH, BCR_RESTORE_DEFAULTS_RESPONSE_P, BCR_RESTORE_DEFAULTS_RESPONSE_LENGTH, 
+		BCR_RESTORE_DEFAULTS_RESPONSE_LENGTH, NUM_BCR_CMD_TRIES, BCR_CMD_TIMEOUT,
+	//CMD_BCR_CUSTOMIZE_DEFAULTS
+	CMD_F_BCR, BCR_CUSTOMIZE_DEFAULTS_CMD_P, BCR_CUSTOMIZE_DEFAULTS_CMD_LENGTH, BCR_CUSTOMIZE_DEFAULTS_RESPONSE_P, BCR_CUSTOMIZE_DEFAULTS_RESPONSE_LENGTH, 
+		BCR_CUSTOMIZE_DEFAULTS_RESPONSE_LENGTH, NUM_BCR_CMD_TRIES, BCR_CMD_TIMEOUT,
+	//CMD_BT_SET_BAUD - the module may answer at the new rate, so the answer isn't checked; calibration finds the rate
+	CMD_F_NO_REPLY|CMD_F_UNCOUNTED, BT_SET_BAUD_CMD_P, BT_SET_BAUD_CMD_LENGTH, 0, 0, 0, 1, 0,
+	//CMD_BT_PROMPT_ONCE - probes a baud rate
+	0, BT_CR_P, BT_CR_LENGTH, BT_PROMPT_P, BT_PROMPT_LENGTH, 0, 1, BT_CMD_TIMEOUT,
+	//CMD_BCR_PING - an interrogate that probes an osctune setting
+	CMD_F_BCR, BCR_INTERROGATE_CMD_P, BCR_INTERROGATE_CMD_LENGTH, BCR_RESPONSE_START_P, BCR_INTERROGATE_RESPONSE_START_LENGTH, 
+		BCR_INTERROGATE_RESPONSE_LENGTH, 1, BCR_CMD_TIMEOUT,
+	//CMD_BT_GET_NAME, CMD_BT_GET_ENCRYPT, CMD_BT_GET_TXPOWER - succeed if the reply shows the desired value;
+	//in a sequence, the set command that follows is only sent if it doesn't
+	CMD_F_OR_NEXT|CMD_F_CHECK_ANYWHERE, BT_GET_NAME_CMD_P, BT_GET_NAME_CMD_LENGTH, BT_NAME_VALUE_P, BT_NAME_VALUE_LENGTH, 
+		0, 1, BT_CMD_TIMEOUT,
+	CMD_F_OR_NEXT|CMD_F_CHECK_ANYWHERE, BT_GET_ENCRYPT_CMD_P, BT_GET_ENCRYPT_CMD_LENGTH, BT_ENCRYPT_VALUE_P, BT_ENCRYPT_VALUE_LENGTH, 
+		0, 1, BT_CMD_TIMEOUT,
+	CMD_F_OR_NEXT|CMD_F_CHECK_ANYWHERE, BT_GET_TXPOWER_CMD_P, BT_GET_TXPOWER_CMD_LENGTH, BT_TXPOWER_VALUE_P, BT_TXPOWER_VALUE_LENGTH, 
+		0, 1, BT_CMD_TIMEOUT
+};
+
+//Sequences are lists of CMD_T values, interleaved with the steps below, ending with SEQ_END
+typedef enum {
+	SEQ_ENTER_BT_CMD_MODE=0xF0,
+	SEQ_EXIT_BT_CMD_MODE,
+	SEQ_SELECT_BT,
+	SEQ_SELECT_WIRED,
+	SEQ_WAKE_BCR, 			//Release-to-wakeup delay, wake the reader, wakeup-to-interrogate delay
+	SEQ_BCR_DR_DELAY, 		//Interrogate-to-data-ready delay
+	SEQ_RELEASE_BCR, 		//Prepare for next barcode reader wake-up
+	SEQ_CALIBRATE_BT_BAUD, 	//Find the bluetooth module's baud rate; counted
+	SEQ_PROBE_BT_BAUD, 		//Check the module answers at the stored baud rate, or find its rate; counted
+	SEQ_CALIBRATE_OSCTUNE, 	//Trim osctune against the (awake) barcode reader; counted
+	SEQ_ENSURE_BT_BAUD, 	//Set and calibrate the fastest baud rate, unless that's what we're already at; counted
+	SEQ_ENSURE_OSCTUNE, 	//Calibrate osctune, unless a trim is stored; counted
+	SEQ_APPLY_BCR_DEFAULTS, //Restore the barcode reader's defaults and customize them; counted
+	SEQ_ENSURE_BCR_DEFAULTS,//SEQ_APPLY_BCR_DEFAULTS, unless this version of them was already applied; counted
+	SEQ_END=0xFF,
+} SEQ_STEP_T;
+
+rom char * program_defaults_seq = {
+	//Bluetooth module: find its rate and verify command mode, reset, again, customize
+	SEQ_SELECT_BT,
+	SEQ_ENTER_BT_CMD_MODE,
+	SEQ_PROBE_BT_BAUD,
+	CMD_BT_PROMPT,
+	CMD_BT_RST_FACTORY,
+	SEQ_EXIT_BT_CMD_MODE,
+	SEQ_ENTER_BT_CMD_MODE,
+	SEQ_PROBE_BT_BAUD, //The reset may have changed it
+	CMD_BT_PROMPT_ACK,
+	CMD_BT_PROMPT,
+	CMD_BT_SET_NAME,
+	CMD_BT_SET_ENCRYPT,
+	CMD_BT_SET_TXPOWER,
+	CMD_BT_SET_BAUD,
+	SEQ_CALIBRATE_BT_BAUD,
+	CMD_BT_RET,
+	SEQ_EXIT_BT_CMD_MODE,
+	SEQ_SELECT_WIRED,
+	//Barcode reader: connect, trim the clock, restore defaults, customize, power down
+	SEQ_WAKE_BCR,
+	CMD_BCR_INTERROGATE,
+	SEQ_CALIBRATE_OSCTUNE,
+	SEQ_BCR_DR_DELAY,
+	SEQ_APPLY_BCR_DEFAULTS,
+	CMD_BCR_POWER_DOWN,
+	SEQ_RELEASE_BCR,
+	SEQ_END
+};
+
+//Provisioning checks first and only writes what differs; a unit that's already configured goes through
+//without a reset, a baud search or an osctune sweep. Any failure falls back to program_defaults_seq.
+rom char * provision_seq = {
+	//Bluetooth module: verify the stored baud rate (finding the module's, if it's wrong) and command
+	//mode, check and fix each setting
+	SEQ_SELECT_BT,
+	SEQ_ENTER_BT_CMD_MODE,
+	SEQ_PROBE_BT_BAUD,
+	CMD_BT_PROMPT,
+	CMD_BT_GET_NAME,
+	CMD_BT_SET_NAME,
+	CMD_BT_GET_ENCRYPT,
+	CMD_BT_SET_ENCRYPT,
+	CMD_BT_GET_TXPOWER,
+	CMD_BT_SET_TXPOWER,
+	SEQ_ENSURE_BT_BAUD,
+	CMD_BT_RET,
+	SEQ_EXIT_BT_CMD_MODE,
+	SEQ_SELECT_WIRED,
+	//Barcode reader: connect, then only what's missing
+	SEQ_WAKE_BCR,
+	CMD_BCR_INTERROGATE,
+	SEQ_ENSURE_OSCTUNE,
+	SEQ_BCR_DR_DELAY,
+	SEQ_ENSURE_BCR_DEFAULTS,
+	CMD_BCR_POWER_DOWN,
+	SEQ_RELEASE_BCR,
+	SEQ_END
+};
+//--------------------------------------------
+
+
 
 //This flag is set when the system knows the barcode reader needs to be queried for any bar codes. 
 //(The flag is set by an interrupt generated by the barcode reader button.) The flag is cleared 
 //after the barcode reader is queried.
-unsigned char query_bcr_f=0; //Flag set by the BCR Button Interrupt. Cleared after BCR has been queried
+unsigned char query_bcr_f @QUERY_BCR_F_ADDR; //Flag set by the BCR Button Interrupt. Cleared after BCR has been queried
 
 
 
@@ -242,13 +690,17 @@ void disable_EEPROM_writes(void) {
 	eecon1 &= 0xFB; //WREN
 }
 unsigned char read_EEPROM_byte(unsigned char pos) {
+	while ( (eecon1&0x02) != 0 ){ WAIT_SPIN(); } //Not while a write is going
 	eeadr = pos; //Write address into memory
 	eecon1 &= 0x7F; //EEPGD - 0 accesses data memory
 	eecon1 |= 0x01; //RD - Initiates a read
 	while ( (eecon1&0x01) != 0 ){}; //Still reading
 	return eedata;
 }
-void write_EEPROM_byte(unsigned char b, unsigned char pos) {
+//Starts a write; it finishes on its own, ~5 ms later
+void start_EEPROM_write(unsigned char b, unsigned char pos) {
+
+	while ( (eecon1&0x02) != 0 ){ WAIT_SPIN(); } //A previous write is still going
 
 	intcon &= 0x7F; //Set GIE to 0 to disable interrupts globally
 
@@ -260,27 +712,184 @@ void write_EEPROM_byte(unsigned char b, unsigned char pos) {
 	eecon1 |= 0x02; //Special Sequence, Step 3 - WR (Bit 1) - Initiates a write
 
 	intcon |= 0x80; //Set GIE to 1 to enable interrupts globally
+}
+void write_EEPROM_byte(unsigned char b, unsigned char pos) {
+	start_EEPROM_write(b, pos);
+	while ( (eecon1&0x02) != 0 ){ WAIT_SPIN(); } //Still writing
+}
+
+//Session Trace
+//+++++++++++++++++++++++++++++++++++++++++++++
+//When armed (console "cap"), the delivery states log every byte sent and received, on either channel, 
+//into spare EEPROM, for replaying real sessions against changes to Send()/ListenForResponse() (console 
+//"dump" prints it; Tools/trace_replay.py lists it, or plays one channel's peer back from it). Each 
+//wake-up's session is appended until the trace is full. The trace is a series 
+//of runs, each its bytes followed by a two byte trailer, so it's read from the end backwards:
+//	<n bytes> <tag: 0x80 if received, | 0x40 if on the bluetooth channel, | n (1-63)> <delta>
+//where delta is the ms from the previous run's last byte to this run's first: 0-127 as is, then 
+//(delta-126)*64, to 255 (8 sec or more). Bytes in one direction on one channel, less than TRACE_RUN_GAP
+//apart, make one run. An empty run (0x00 0x00) starts each session. Bytes are timestamped by timer0.
+//An EEPROM write takes ~5 ms, far slower than a reply arrives, so bytes are staged in RAM and written 
+//one at a time whenever something is waiting anyway (TraceService()); if a burst outruns the stage,
+//the trace stops there rather than holding things up.
+#define TRACE_STAGE_LENGTH 24
+#define TRACE_TRAILER_LENGTH 2
+#define TRACE_RX 0x80
+#define TRACE_BT 0x40
+#define TRACE_MAX_RUN 0x3F
+#define TRACE_RUN_GAP 3 //ms; a frame takes ~1.1 ms at 9600
+#define TRACE_ARMED 0x01 //EEPROM_TRACE_STATE_POS values; erased means off
+#define TRACE_STOPPED 0x02 //Full, or a burst outran the stage
 
-	while ( (eecon1&0x02) != 0 ){}; //Still writing
+typedef struct {
+	unsigned char on;
+	unsigned char stopped;
+	unsigned char length; //Bytes of trace, written or staged
+	unsigned char pos; //EEPROM address for the next staged byte
+	unsigned char head; //Next staged byte out
+	unsigned char used; //Staged bytes
+	unsigned char n; //Bytes in the current run
+	unsigned char tag;
+	unsigned char delta;
+	unsigned short last; //Tick of the last byte
+} trace_t;
+trace_t trace;
+unsigned char trace_stage[TRACE_STAGE_LENGTH];
+
+//Room is checked by the caller
+void TraceStage(unsigned char b) {
+	unsigned char i = trace.head+trace.used;
+	if (i>=TRACE_STAGE_LENGTH) {
+		i -= TRACE_STAGE_LENGTH;
+	}
+	trace_stage[i] = b;
+	trace.used++;
+	trace.length++;
 }
-void BT_Address2Buff(const unsigned char * buff) {
-	unsigned char i;
-	for (i=0; i<BT_ADDRESS_LENGTH; i++) {
-		buff[i] = read_EEPROM_byte(i);
+
+//Starts writing the next staged byte, if the EEPROM is free. Never waits.
+void TraceService(void) {
+	if (trace.used==0 || (eecon1 & 0x02)) { //WR
+		return;
+	}
+	enable_EEPROM_writes();
+	start_EEPROM_write(trace_stage[trace.head], trace.pos);
+	disable_EEPROM_writes();
+	trace.pos++;
+	trace.head++;
+	if (trace.head>=TRACE_STAGE_LENGTH) {
+		trace.head = 0;
+	}
+	trace.used--;
+}
+//--------------------------------------------
+
+
+void ArenaHoldBarcode(unsigned char offset, unsigned char length) {
+	//Keep the record in place; later replies only use the arena bytes in front of it
+	barcode_view.offset = offset;
+	barcode_view.length = length;
+	barcode_view.seq = tx_seq;
+	tx_seq++;
+	rx_buff_length = offset;
+}
+void ArenaReleaseBarcode(void) {
+	barcode_view.length = 0;
+	rx_buff_length = RX_BUFF_LENGTH;
+}
+
+
+//Button Gestures
+//+++++++++++++++++++++++++++++++++++++++++++++
+//The timer0 ISR samples each enabled button once a ms, debounces it with an integrator, and 
+//timestamps its debounced edges. ButtonEvent() turns those into gesture events for the main loop, 
+//without blocking. The clock stays at CLK_ACTIVE while a button is sampled (see ms_delay()).
+#define BTN_DEBOUNCE_MS 10 	//Raw level must persist this long to count
+#define BTN_NOISE_MS 20 		//Shorter presses are ignored
+#define BTN_SHORT_MAX_MS 235 	//Presses at least this long are long presses
+#define BTN_DOUBLE_GAP_MS 300 	//A second short press within this long makes a double press
+#define BTN_HOLD_STEP_MS 4000 	//While held, a hold event every this long
+
+typedef enum {
+	BTN_EV_NONE=0,
+	BTN_EV_SHORT_PRESS,
+	BTN_EV_LONG_PRESS,
+	BTN_EV_DOUBLE_PRESS,
+	BTN_EV_HOLD, //Still down; button.holds says for how many steps
+} BTN_EV_T;
+
+typedef struct {
+	unsigned char sampling; //The ISR only samples the button while this is set
+	unsigned char integ; //Debounce integrator, 0..BTN_DEBOUNCE_MS
+	unsigned char is_down; //Debounced
+	unsigned char presses; //Completed presses; counted by the ISR
+	unsigned char presses_taken; //Completed presses ButtonEvent() has classified
+	unsigned short down_tick;
+	unsigned short up_tick;
+	unsigned char pending_short; //A short press, waiting to see if it's half of a double
+	unsigned char holds; //Hold steps reported during the current press
+} button;
+button bcr_btn; //RA2, high when down
+button btn1; //RA5, low when down; readable only with secondary power on and the wired channel selected
+//--------------------------------------------
+
+
+unsigned char sys_clk = CLK_ACTIVE;
+unsigned char isr_ticks_per_ms @ISR_TICKS_PER_MS_ADDR; //Set by SetSysClk()
+unsigned char isr_ms_per_tick @ISR_MS_PER_TICK_ADDR;
+unsigned char isr_sub_tick @ISR_SUB_TICK_ADDR;
+unsigned char serial_baud = BAUD_9600; //Baud rate of the selected channel
+
+void SetBaud(unsigned char baud) {
+	serial_baud = baud;
+	spbrgh = 0;
+	spbrg = brg_table[sys_clk*NUM_BAUDS+baud];
+}
+
+//SetSysClk()
+//
+//Switches the internal oscillator speed, and rescales everything that depends on it (timer0 ticks, 
+//the baud rate generator). Returns the previous clock, so callers can restore it.
+//
+unsigned char SetSysClk(unsigned char clk) {
+	unsigned char prev_clk = sys_clk;
+	if (clk==sys_clk) {
+		return prev_clk;
+	}
+
+	//Let any byte still in the shift register go out at the old rate
+	while (!(txsta & 0x02)) { //TRMT
+		WAIT_SPIN();
 	}
-	buff[i] = '\0'; //for good measure
-} 
 
+	intcon &= 0x7F; //Set GIE to 0 to disable interrupts globally
+	osccon = (osccon & 0x8F) | clk_ircf[clk];
+	sys_clk = clk;
+	isr_ticks_per_ms = clk_ticks_per_ms[clk];
+	isr_ms_per_tick = clk_ms_per_tick[clk];
+	isr_sub_tick = 0;
+	SetBaud(serial_baud);
+	intcon |= 0x80; //Set GIE to 1 to enable interrupts globally
+
+	if (clk!=CLK_IDLE) {
+		while (!(osccon & 0x04)) { WAIT_SPIN(); } //HTS - wait for the high frequency oscillator to be stable
+	}
+	return prev_clk;
+}
 
 void InitSysClk(void) {
 	//Run from internal oscillar, set speed
-	osccon |= 0x40; //Set IRCF to 100=1MHz
-	osccon &= 0xCF;
 	osccon &= 0xF7; //Clear OSTS to 0
 	osccon &= 0xFE; //SCS set to 0 //Commented out to control with CONFIG FOSC<2:0>
+	sys_clk = CLK_IDLE; //Force the switch
+	SetSysClk(CLK_ACTIVE);
 } 
 void InitTimer0(void) {
 	timer0_isr_count=0;
+	coarse_s = 0;
+	coarse_ms = 0;
+	bcr_btn.sampling = 0;
+	btn1.sampling = 0;
 	InitSysClk();
 	option_reg &= 0xDF; //Clear T0CS to 0 so timer increments on instruction clock
 	intcon &= 0xF8; //Clear all interrupt flags
@@ -295,6 +904,8 @@ void EnableBcrButtonInterrupt(void) {
 void DisableBcrButtonInterrupt(void) {
 	intcon &= 0xEF; //Clear INTE (bit 4) to 0 to disable external RA2 interrupt
 }
+
+
 void interrupt(void) {
 	//NOTE: registers may not be preserved in interrupts by the SourceBoost c compiler; 
 	//take care not to accidentally use them here.
@@ -305,7 +916,48 @@ void interrupt(void) {
 	//Handle Timer0 Overflow
 	int_src = intcon & 0x04;
 	if(int_src) { //T0IF	
-		timer0_isr_count++;
+		isr_sub_tick++;
+		if (isr_sub_tick>=isr_ticks_per_ms) {
+			isr_sub_tick = 0;
+			timer0_isr_count += isr_ms_per_tick;
+			coarse_ms += isr_ms_per_tick;
+			if (coarse_ms>=1000) {
+				coarse_ms -= 1000;
+				coarse_s++;
+			}
+
+			//Sample buttons
+			if (bcr_btn.sampling) {
+				if (porta & 0x04) { 
+					if (bcr_btn.integ<BTN_DEBOUNCE_MS) bcr_btn.integ++;
+				} else if (bcr_btn.integ>0) {
+					bcr_btn.integ--;
+				}
+				if (bcr_btn.integ==BTN_DEBOUNCE_MS && !bcr_btn.is_down) {
+					bcr_btn.is_down = 1;
+					bcr_btn.down_tick = timer0_isr_count;
+				} else if (bcr_btn.integ==0 && bcr_btn.is_down) {
+					bcr_btn.is_down = 0;
+					bcr_btn.up_tick = timer0_isr_count;
+					bcr_btn.presses++;
+				}
+			}
+			if (btn1.sampling) {
+				if ((porta & 0x20)==0) { 
+					if (btn1.integ<BTN_DEBOUNCE_MS) btn1.integ++;
+				} else if (btn1.integ>0) {
+					btn1.integ--;
+				}
+				if (btn1.integ==BTN_DEBOUNCE_MS && !btn1.is_down) {
+					btn1.is_down = 1;
+					btn1.down_tick = timer0_isr_count;
+				} else if (btn1.integ==0 && btn1.is_down) {
+					btn1.is_down = 0;
+					btn1.up_tick = timer0_isr_count;
+					btn1.presses++;
+				}
+			}
+		}
 		intcon &= 0xFB; //Clear T0IF interrupt flag, ready for next
 	}
 	//Handle External Interrupt (RA2)
@@ -320,18 +972,29 @@ void interrupt(void) {
 interval GetInterval(unsigned short wait) {
 	interval res;
 	res.start_tick = timer0_isr_count;
-	res.end_tick = res.start_tick+wait;
-	//If end_t val is wrong due to timer wrap...
-	if (res.start_tick > res.end_tick) {
-		res.end_tick = wait - (MAX_U16-res.start_tick);
-		res.will_wrap = 1;
-	} else {
-		res.will_wrap = 0;
-	}
+	res.wait = wait;
 	return res;
 }
 
-void ms_delay(unsigned short x) { //Presumes 1MHz clock and default timer-prescaler. Err on slow side...
+//Returns 1 once an interval is over. Compares the time elapsed since the start, so the count may step 
+//(33 at a time at CLK_IDLE, a whole sleep slice at once) across a wrap without missing the end. Has 
+//to be polled at least once per timer0 wrap (~65 sec).
+unsigned char IntervalOver(interval * iv) {
+	return ((unsigned short)(timer0_isr_count - iv->start_tick) >= iv->wait);
+}
+
+//IntervalOver(), for a start tick kept elsewhere (a button's edges)
+unsigned char TickOver(unsigned short start_tick, unsigned short wait) {
+	return ((unsigned short)(timer0_isr_count - start_tick) >= wait);
+}
+
+//One time round a wait (see Waiting, and WAIT_SPIN())
+void WaitIdle(void) {
+	WAIT_SPIN();
+	TraceService();
+}
+
+void ms_delay(unsigned short x) { //Presumes default timer-prescaler. Err on slow side...
 	//Clip values (a safety...)
 	if (x<MINIMUM_DELAY) { 
 		x = MINIMUM_DELAY;
@@ -339,17 +1002,75 @@ void ms_delay(unsigned short x) { //Presumes 1MHz clock and default timer-presca
 	} else if (x>MAXIMUM_DELAY) {
 		x=MAXIMUM_DELAY;
 	}
+	//Long delays don't need a fast clock, unless a button is being sampled: its debouncing and 
+	//timestamps count on a tick a ms (at CLK_IDLE, debouncing would take ~330 ms)
+	unsigned char prev_clk = sys_clk;
+	if (x>=CLOCK_IDLE_MIN_DELAY && !bcr_btn.sampling && !btn1.sampling) {
+		prev_clk = SetSysClk(CLK_IDLE);
+	}
 	interval di = GetInterval(x);
-	if (di.will_wrap) {
-		//Wait for timer to wrap around...
-		while(timer0_isr_count>di.end_tick) {
-			clear_wdt();
-		} 
+	while (!IntervalOver(&di)) {
+		WaitIdle();
 	}
-	//Wait for the end of the delay
-	while (timer0_isr_count < di.end_tick) {
-		clear_wdt();
+	SetSysClk(prev_clk);
+}
+
+
+//Retry Policy
+//A retry loop runs "while (RetryNext(&r)) {...}". Each retry waits out a backoff that doubles up to
+//a cap, plus up to half again of jitter (so two devices that failed together don't retry together).
+//Within a session (a wake-up's worth of radio use), every loop also stops once the session's time 
+//budget is spent; whatever wasn't delivered stays queued for the next one. A loop that has to run
+//past the budget (cleaning up after the session) clears budgeted.
+typedef struct {
+	unsigned char tries;
+	unsigned char max_tries;
+	unsigned short backoff; //ms before the next retry; a power of 2, at least 2 (or 0 for none)
+	unsigned short max_backoff;
+	unsigned char budgeted; //Stops when the session's budget is spent
+} retry_policy;
+
+interval session;
+unsigned char session_on = 0;
+
+void SessionStart(unsigned short budget) {
+	session = GetInterval(budget);
+	session_on = 1;
+}
+void SessionEnd(void) {
+	session_on = 0;
+}
+unsigned char SessionOver(void) {
+	if (!session_on) {
+		return 0;
+	}
+	return IntervalOver(&session);
+}
+
+void RetryInit(retry_policy * r, unsigned char max_tries, unsigned short backoff, unsigned short max_backoff) {
+	r->tries = 0;
+	r->max_tries = max_tries;
+	r->backoff = backoff;
+	r->max_backoff = max_backoff;
+	r->budgeted = 1;
+}
+
+//Returns 1 if another attempt may be made, after backing off if it's a retry
+unsigned char RetryNext(retry_policy * r) {
+	if (r->tries>=r->max_tries || (r->budgeted && SessionOver())) {
+		return 0;
+	}
+	if (r->tries!=0 && r->backoff!=0) {
+		ms_delay(r->backoff + (timer0_isr_count & ((r->backoff>>1)-1)));
+		if (r->backoff<r->max_backoff) {
+			r->backoff <<= 1;
+		}
+		if (r->budgeted && SessionOver()) {
+			return 0;
+		}
 	}
+	r->tries++;
+	return 1;
 }
 
 
@@ -392,48 +1113,96 @@ void ConfigPin2ForButton(void) {
 	trisa |= 0x20; //Set Pin 2 as input; (TRISA5 to 1)
 }
 static unsigned char should_be_in_bt_command_mode_when_powered_and_bt_selected=0;
-void EnterBTCommandMode(void) {
+
+//EB101 modem state, as learned from its replies since it was powered. Lets the connect and 
+//disconnect handshakes skip the prompt check and the "ret" exchange when they'd tell us nothing new.
+#define BT_S_ALIVE 0x01 		//It has answered a prompt
+#define BT_S_LINK_KNOWN 0x02 	//BT_S_CONNECTED can be trusted
+#define BT_S_CONNECTED 0x04
+unsigned char bt_state = 0;
+
+unsigned char InBTCommandMode(void) {
 	//NOTE: Assumes secondary power, and 2:1 select line to be 1
-	porta &= 0xDF; //Clear RA5 (Pin 2) to 0
-	ms_delay(20);
-	should_be_in_bt_command_mode_when_powered_and_bt_selected = 1;
+	return ((porta&0x20)==0); //RA5 (Pin 2) is 0
 }
-unsigned char InBTCommandMode(void) {
+void EnterBTCommandMode(void) {
 	//NOTE: Assumes secondary power, and 2:1 select line to be 1
-	return (porta&0x20==0); //RA5 (Pin 2) is 0
+	should_be_in_bt_command_mode_when_powered_and_bt_selected = 1;
+	if (InBTCommandMode() && (trisa&0x20)==0) { //Already driving it low
+		return;
+	}
+	porta &= 0xDF; //Clear RA5 (Pin 2) to 0
+	ms_delay(BT_MODE_SWITCH_DELAY);
 }
 void ExitBTCommandMode(void) {
 	//NOTE: Assumes secondary power, and 2:1 select line to be 1
 	porta |= 0x20; //Set RA5 (Pin 2) to 1
-	ms_delay(20);
+	ms_delay(BT_MODE_SWITCH_DELAY);
 	should_be_in_bt_command_mode_when_powered_and_bt_selected = 0;
 }
 unsigned char ButtonIsDown(void) {
 	//NOTE: Assumes secondary power, and 2:1 select line to be 0
 	return ((porta & 0x20)==0);
 }
-unsigned char ButtonHeldDown(unsigned short duration) {
-	//NOTE: Assumes secondary power, and 2:1 select line to be 0
-	if (ButtonIsDown()) {
-		interval hi = GetInterval(duration); //hold interval
-		while (1) {
-			if (hi.will_wrap) {
-				if (timer0_isr_count<hi.end_tick) { //wrap has happened
-					hi.will_wrap = 0; //no longer anticipating wrap
-				}
-			}	
-			else if (timer0_isr_count>=hi.end_tick) {
-				return 1;
-			}
-		
-			if (!ButtonIsDown()) {
-				return 0;
-			}
-			clear_wdt();
+void StartButtonSampling(button * b) {
+	b->sampling = 0;
+	b->integ = 0;
+	b->is_down = 0;
+	b->presses = 0;
+	b->presses_taken = 0;
+	b->pending_short = 0;
+	b->holds = 0;
+	b->sampling = 1;
+}
+void StopButtonSampling(button * b) {
+	b->sampling = 0;
+}
+
+//True once nothing more can come of the button's recent activity
+unsigned char ButtonIdle(button * b) {
+	return (b->integ==0 && !b->is_down && !b->pending_short && b->presses==b->presses_taken);
+}
+
+unsigned char ButtonEvent(button * b) {
+	unsigned short t;
+
+	//A press has ended
+	if (b->presses!=b->presses_taken) {
+		b->presses_taken++;
+		b->holds = 0;
+		t = b->up_tick - b->down_tick; //Unsigned, so right across a timer wrap
+		if (t<BTN_NOISE_MS) {
+			return BTN_EV_NONE;
+		}
+		if (t>=BTN_SHORT_MAX_MS) {
+			b->pending_short = 0;
+			return BTN_EV_LONG_PRESS;
 		}
+		if (b->pending_short) {
+			b->pending_short = 0;
+			return BTN_EV_DOUBLE_PRESS;
+		}
+		b->pending_short = 1;
+		return BTN_EV_NONE;
 	}
-	//Otherwise...
-	return 0;
+
+	//No second press in time
+	if (b->pending_short && !b->is_down) {
+		if (TickOver(b->up_tick, BTN_DOUBLE_GAP_MS)) {
+			b->pending_short = 0;
+			return BTN_EV_SHORT_PRESS;
+		}
+	}
+
+	//Still held
+	if (b->is_down) {
+		if (TickOver(b->down_tick, (b->holds+1)*BTN_HOLD_STEP_MS)) {
+			b->holds++;
+			return BTN_EV_HOLD;
+		}
+	}
+
+	return BTN_EV_NONE;
 }
 void bl_test(void) {
 	//NOTE: Assumes secondary power, and 2:1 select line to be 0
@@ -473,6 +1242,7 @@ void TurnSecondaryPowerOff(void) {
 		portc &= 0xFB ;  //Set C2 (Pin 8) to 0
 		ms_delay(SECONDARY_POWER_DELAY);
 	}
+	bt_state = 0; //Forgets everything
 }
 void InitSecondaryPower(void) {
 	TurnSecondaryPowerOff(); //Clear C2
@@ -482,23 +1252,45 @@ void InitSecondaryPower(void) {
 }
 
 
+unsigned char bt_baud = BAUD_9600;
+unsigned char wired_baud = BAUD_9600; //The CS-1504 and PC both run at 9600
+
 void ConfigSerialForBlueTooth(void) {
 	//No parity bit 
 	txsta = 0x24; 
 	rcsta = 0x90; 
+	SetBaud(bt_baud);
 }
 
 void ConfigSerialForWired(void) {
 	//Includes parity bit
 	txsta = 0x64; 
 	rcsta = 0xD0; 
+	SetBaud(wired_baud);
+}
+
+void LoadSerialCalibration(void) {
+	unsigned char b;
+
+	b = read_EEPROM_byte(EEPROM_BT_BAUD_POS);
+	if (b<NUM_BAUDS) {
+		bt_baud = b;
+	}
+
+	b = read_EEPROM_byte(EEPROM_OSCTUNE_POS);
+	if (b!=EEPROM_NOT_SET) {
+		osctune = b;
+	} else {
+		//osctune = 0x0F; //max frequency
+		osctune = 0x00; //middle frequency
+		//osctune = 0x10; //minimum frequency
+	}
 }
 
 void InitSerial(void) {
 
-	//osctune = 0x0F; //max frequency
-	osctune = 0x00; //middle frequency
-	//osctune = 0x10; //minimum frequency
+	//Trimmed osctune and bluetooth baud rate, if calibrated
+	LoadSerialCalibration();
 
 	//TX Pin - output
 	trisc &= 0xEF; //TRISC4 = 0;
@@ -519,8 +1311,8 @@ void InitSerial(void) {
 	baudctl = 0x00;
 	baudctl |= 0x08; //Set BRG16 (bit 3) to 1
 
-	// Set Baudrade - 9600 (from datasheet baudrade table)
-	spbrg = 25;
+	// Set Baudrade for the wired channel
+	SetBaud(wired_baud);
 }
 
 
@@ -584,32 +1376,110 @@ unsigned char GetDR(void) {
 }
 
 
-unsigned char set_tx_parity_bit(unsigned char byte) {
-	//With odd parity, the parity bit is selected so that the number of 1-bits 
-	//in a byte, including the parity bit, is odd. 	
-	unsigned char num_ones;
-	num_ones = 0;
-	while (byte!=0) {
-		if (byte&0x01) {
-			num_ones++;
-		}
-		byte >>= 1;
-	}
-	
-	//If the number of ones in the byte-to-be-sent is already odd...
-	if (num_ones&0x01) {  //clear the parity bit to 0 
-		txsta &= 0xFE; 
+//Secondary power straight from the sleep pin configuration, with the TX pin idling high rather
+//than holding the just-powered peripherals' RX lines low, and HI released (the sleep level asks 
+//the barcode reader to wake, which would cut short its release-to-wake delay)
+void WarmUpSecondaryPower(void) {
+	portc |= 0x10; //Set Pin 6 (C4) high
+	SetHIto(0);
+	TurnSecondaryPowerOn();
+}
+//Back to the sleep pin configuration
+void CoolDownSecondaryPower(void) {
+	TurnSecondaryPowerOff();
+	SetHIto(1);
+	portc &= 0xEF; //Set Pin 6 (C4) low 
+}
+
+
+//1 for each nibble with an odd number of 1-bits
+rom char * nibble_ones_odd = {0,1,1,0, 1,0,0,1, 1,0,0,1, 0,1,1,0};
+
+//With odd parity, the parity bit is selected so that the number of 1-bits 
+//in a byte, including the parity bit, is odd. 	
+unsigned char odd_parity_bit(unsigned char byte) {
+	//The byte has an odd number of ones if exactly one of its nibbles does
+	if (nibble_ones_odd[byte>>4] ^ nibble_ones_odd[byte&0x0F]) {
 		return 0;
 	}
-	//Else the number of ones in the byte-to-be-sent is even..
-	txsta |= 0x01; //set the parity bit to 1
 	return 1;
+}
+
+unsigned char set_tx_parity_bit(unsigned char byte) {
+	if (odd_parity_bit(byte)) {
+		txsta |= 0x01; //set the parity bit to 1
+		return 1;
+	}
+	txsta &= 0xFE; //clear the parity bit to 0 
+	return 0;
 }	
 
+//Checks a received byte against the rcsta read just before it was taken from rcreg (reading 
+//rcreg loads the FERR and RX9D of the next byte). Returns 1 if it arrived intact.
+unsigned char rx_byte_ok(unsigned char rx_status, unsigned char byte) {
+	if (!(rx_status & 0x40)) { //RX9 - no parity on this channel
+		return 1;
+	}
+	if (rx_status & 0x04) { //FERR (Bit 2)
+		return 0;
+	}
+	return ((rx_status & 0x01)==odd_parity_bit(byte)); //RX9D (Bit 0)
+}
+
+//Session trace runs (see Session Trace)
+unsigned char TraceDeltaCode(unsigned short ms) {
+	if (ms<128) {
+		return ms;
+	}
+	ms = (ms>>6)+126;
+	if (ms>255) {
+		return 255;
+	}
+	return ms;
+}
+
+void TraceEndRun(void) {
+	if (trace.n!=0) {
+		TraceStage(trace.tag|trace.n);
+		TraceStage(trace.delta);
+		trace.n = 0;
+	}
+}
+
+void TraceByte(unsigned char tag, unsigned char c) {
+	unsigned short now;
+	if (!trace.on) {
+		return;
+	}
+	now = timer0_isr_count;
+	if (BlueToothSerialSelected()) {
+		tag |= TRACE_BT;
+	}
+	if (trace.n!=0 && (tag!=trace.tag || (unsigned short)(now-trace.last)>TRACE_RUN_GAP || trace.n==TRACE_MAX_RUN)) {
+		TraceEndRun();
+	}
+	//Room for the byte and its run's trailer, in the stage and in the EEPROM
+	if (trace.used+1+TRACE_TRAILER_LENGTH>TRACE_STAGE_LENGTH || 
+		trace.length+1+TRACE_TRAILER_LENGTH>EEPROM_TRACE_LENGTH) {
+		TraceEndRun();
+		trace.on = 0;
+		trace.stopped = 1;
+		return;
+	}
+	if (trace.n==0) {
+		trace.tag = tag;
+		trace.delta = TraceDeltaCode(now-trace.last);
+	}
+	TraceStage(c);
+	trace.n++;
+	trace.last = now;
+}
+
 void  WriteChar(unsigned char byte) {
 	// wait until register is empty 
 	while(!(pir1 & 0x2)) { //TXIF
-		clear_wdt();
+		WAIT_SPIN(); //WaitIdle(), a call shallower
+		TraceService();
 	}
 	if(!BlueToothSerialSelected()) {
 		//Set the parity bit
@@ -617,6 +1487,7 @@ void  WriteChar(unsigned char byte) {
 	}
 	// transmite byte	
 	txreg = byte;
+	TraceByte(0, byte);
 }
 
 unsigned char ReadChar(void) {
@@ -627,7 +1498,7 @@ unsigned char ReadChar(void) {
 	}
 	//Waiting to receive a character...
 	while(!(pir1 & 0x20)) { //RXIF
-		clear_wdt();
+		WaitIdle();
 	}
 	//Received a character!
 	return rcreg;	
@@ -763,50 +1634,353 @@ void PrintBufferBytes(const unsigned char * buff, unsigned char len) {
 	WriteStr(dashes_s);
 }
 
+void WriteEEPROMBytes(unsigned char pos, unsigned char len) {
+	unsigned char i;
+	clear_wdt();
+	for (i=0; i<len; i++) {
+		WriteChar(read_EEPROM_byte(pos+i));
+	}
+}
+
+
+//Barcode validation
+//The first barcode of an upload is validated byte by byte as it arrives (see ListenForResponse()),
+//so the verdict is ready as soon as the reply is. The CS-1504's type byte selects the characters 
+//allowed (as classes, from char_class) and the check digit, if any, that has to verify.
+#define CC_DIGIT 0x01
+#define CC_UPPER 0x02
+#define CC_LOWER 0x04
+#define CC_DASH_DOT 0x08 	//'-' '.'
+#define CC_CODE39 0x10 		//' ' '$' '/' '+' '%'
+#define CC_CODABAR 0x20 	//'$' ':' '/' '+'
+
+//Classes of ascii 0x20-0x7F; anything outside that range has none
+rom char * char_class = {
+	0x10, 0x00, 0x00, 0x00, 0x30, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x00, 0x08, 0x08, 0x30, //0x2_
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, //0x3_
+	0x00, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, //0x4_
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, //0x5_
+	0x00, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, //0x6_
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00 //0x7_
+};
+
+#define BC_CHECK_NONE 0
+#define BC_CHECK_MOD10 1 	//UPC/EAN: weights 3,1,3... from the right of the data, check digit last
+
+#define MAX_SYMBOLOGY_TYPE 14
+#define SYMBOLOGY_RECORD_LENGTH 2
+rom char * symbology_table = {
+	//(Type 0 - none)
+	0, BC_CHECK_NONE,
+	//1 Code 39 (the reader only sends a check digit if it's set to, so none is verified)
+	CC_DIGIT|CC_UPPER|CC_DASH_DOT|CC_CODE39, BC_CHECK_NONE,
+	//2 Codabar (A-D are the start/stop characters, if they're sent)
+	CC_DIGIT|CC_UPPER|CC_DASH_DOT|CC_CODABAR, BC_CHECK_NONE,
+	//3 Code 128
+	CC_DIGIT|CC_UPPER|CC_LOWER|CC_DASH_DOT, BC_CHECK_NONE,
+	//4 Discrete 2 of 5
+	CC_DIGIT, BC_CHECK_NONE,
+	//5 IATA 2 of 5
+	CC_DIGIT, BC_CHECK_NONE,
+	//6 Interleaved 2 of 5 (likewise)
+	CC_DIGIT, BC_CHECK_NONE,
+	//7 Code 93
+	CC_DIGIT|CC_UPPER|CC_LOWER|CC_DASH_DOT, BC_CHECK_NONE,
+	//8 UPC-A
+	CC_DIGIT, BC_CHECK_MOD10,
+	//9 UPC-E0 (its check digit is over the expanded UPC-A, so it isn't verified here)
+	CC_DIGIT, BC_CHECK_NONE,
+	//10 EAN-8
+	CC_DIGIT, BC_CHECK_MOD10,
+	//11 EAN-13
+	CC_DIGIT, BC_CHECK_MOD10,
+	//12 Code 11
+	CC_DIGIT|CC_DASH_DOT, BC_CHECK_NONE,
+	//13 MSI
+	CC_DIGIT, BC_CHECK_NONE,
+	//14 UCC/EAN-128
+	CC_DIGIT|CC_UPPER|CC_LOWER|CC_DASH_DOT, BC_CHECK_NONE
+};
+
+unsigned char bc_check_on @BC_CHECK_ON_ADDR; //Set around uploads by RunCommand()
+
+typedef struct {
+	unsigned char verdict; 	//BC_VALIDITY_T of what's arrived so far
+	unsigned char end; 		//rx_buff index just past the barcode
+	unsigned char classes;
+	unsigned char method; 	//BC_CHECK_*
+	unsigned char sum; 		//Running check sum
+	unsigned char allow[SYMBOLOGY_ALLOW_LENGTH]; //The allow-list, read before the upload starts
+} bc_check_t;
+bc_check_t bc_check;
+
+//Copies the allow-list to RAM before an upload. Reading it mid-reply could wait out a trace byte's 
+//EEPROM write (~5 ms), long enough for the reply to overrun the EUSART.
+void BarcodeCheckStart(void) {
+	unsigned char k;
+	for (k=0; k<SYMBOLOGY_ALLOW_LENGTH; k++) {
+		bc_check.allow[k] = read_EEPROM_byte(EEPROM_SYMBOLOGY_ALLOW_POS+k);
+	}
+	bc_check.verdict = BC_NOT_VALID_LENGTH_ZERO; //Until a reply comes
+}
+
+//Feeds the byte just stored at rx_buff[i] to the validator
+void BarcodeCheckByte(unsigned char i, unsigned char c) {
+	unsigned char b;
+
+	if (i==0) {
+		bc_check.verdict = BC_NOT_VALID_LENGTH_ZERO; //Nothing yet
+	}
+	else if (i==FIRST_BARCODE_STRLEN_I) {
+		//The length includes the type and the 4-byte timestamp that follows the barcode
+		if (c==5) {
+			bc_check.verdict = BC_NOT_VALID_LENGTH_ZERO;
+		}
+		else if (c<5 || (c-5)>MAX_BARCODE_CHARS || (FIRST_BARCODE_START_I+c-5)>=RX_BUFF_LENGTH) {
+			bc_check.verdict = BC_NOT_VALID_LENGTH_TOO_LONG;
+		}
+		else {
+			bc_check.verdict = BC_NOT_VALID_INCOMPLETE;
+			bc_check.end = FIRST_BARCODE_START_I+c-5;
+		}
+	}
+	else if (bc_check.verdict!=BC_NOT_VALID_INCOMPLETE) {
+		return;
+	}
+	else if (i==FIRST_BARCODE_TYPE_I) {
+		if (c==0 || c>MAX_SYMBOLOGY_TYPE) {
+			bc_check.verdict = BC_NOT_VALID_TYPE;
+			return;
+		}
+		b = bc_check.allow[c>>3];
+		if (!(b & (1<<(c&0x07)))) {
+			bc_check.verdict = BC_NOT_ALLOWED_TYPE;
+			return;
+		}
+		bc_check.classes = symbology_table[c*SYMBOLOGY_RECORD_LENGTH];
+		bc_check.method = symbology_table[c*SYMBOLOGY_RECORD_LENGTH+1];
+		bc_check.sum = 0;
+	}
+	else if (i>=FIRST_BARCODE_START_I && i<bc_check.end) {
+
+		//Character class
+		b = 0;
+		if (c>=0x20 && c<0x80) {
+			b = char_class[c-0x20];
+		}
+		if (!(b & bc_check.classes)) {
+			bc_check.verdict = BC_NOT_VALID_CHARACTERS;
+			return;
+		}
+
+		//Check digit
+		if (bc_check.method==BC_CHECK_MOD10) {
+			b = c-48;
+			if ((bc_check.end-i)&0x01) { //Check digit, and every other digit left of it
+				bc_check.sum += b;
+			}
+			else {
+				bc_check.sum += b+b+b;
+			}
+			while (bc_check.sum>=10) {
+				bc_check.sum -= 10;
+			}
+			if (i==bc_check.end-1 && bc_check.sum!=0) {
+				bc_check.verdict = BC_NOT_VALID_CHECK_DIGIT;
+				return;
+			}
+		}
+
+		//Only the last byte, checked, makes it valid; a reply cut short stays incomplete
+		if (i==bc_check.end-1) {
+			bc_check.verdict = BC_VALID;
+		}
+	}
+}
+
+
+//Low-power listening. When the peer starts each of its replies with a preamble byte, 
+//ListenForResponse() sleeps between replies (every listen_wake_frame_length bytes) instead of 
+//spinning. A falling edge on RX (the preamble's start bit) wakes the processor through the EUSART's 
+//wake-up (WUE), and a short WDT period wakes it to check the deadline. The preamble itself is lost 
+//in the wake-up, so it's stored as if it had been received. listen_wake_frame_length==0 turns this off.
+//It only sleeps while a whole slice is left before the timeout, so a listen never overruns it; the 
+//last part of the wait spins.
+unsigned char listen_wake_preamble = 0;
+unsigned char listen_wake_frame_length = 0;
+//As listen_wake_frame_length: sleep only until a reply starts, for replies whose first byte is known
+#define LISTEN_WAKE_FIRST_ONLY 0xFF
+
+//A reply, from its first byte, has to be over within listen_reply_span ms; past that the listen ends as
+//if it had timed out, however recently a byte came (otherwise a peer trickling bytes just inside the 
+//inter-char timeout could hold a listen open indefinitely). LISTEN_REPLY_SPAN is more than a full rx 
+//window at 9600, with room for a few gaps. Callers expecting a reply spread out set it around the call.
+//Not every reply is that short (a reader holding many barcodes uploads them all), so RunCommand() 
+//drains one that's cut off (listen_cut) before anything else is sent: otherwise its tail would land 
+//in the next command's reply.
+#define LISTEN_REPLY_SPAN 150
+unsigned short listen_reply_span = LISTEN_REPLY_SPAN;
+//Most replies are over well inside their span, and a listen for one of unknown length then just runs
+//into the cap. Only one with bytes still arriving (within this many ms, ~10 byte times at 9600) has 
+//really been cut off.
+#define LISTEN_QUIET_GAP 10
+unsigned char listen_cut; //The last listen was cut off while bytes were still arriving
+
+//A listen can pick up where bytes collected meanwhile (CollectRx(), while sending) left off: it starts
+//at rx_buff[listen_rx_start]. It also ends, as a success, once listen_end_lead and listen_end_byte
+//have come one after the other (the acknowledgment of the last frame sent), however many bytes that 
+//took. listen_end_lead==0 turns this off.
+unsigned char listen_rx_start = 0;
+unsigned char listen_end_lead = 0;
+unsigned char listen_end_byte;
+
+//For the console; not initialized, so they can be reported after a reset (ClearStatsAfterPowerOn())
+unsigned char listen_capped; //Listens cut off by their reply span while bytes were still arriving
+unsigned char listen_overflows; //Replies longer than the rx window (the rest was dropped)
+unsigned char slow_deliveries; //Deliveries over DELIVERY_LATENCY_BUDGET
+
+#define LISTEN_SLEEP_WDTCON 0x01 //WDTPS 0000 (1:32) and SWDTEN; with the 1:128 OPTION postscaler, ~132ms
+#define LISTEN_SLEEP_SLICE 132
+
+//Sleeps until RX activity or the end of one WDT slice. Returns 1 if RX activity woke it.
+unsigned char ListenSleep(void) {
+
+	unsigned char saved_wdtcon, wake_status, woke_on_rx;
+	woke_on_rx = 0;
+
+	//Only between bytes
+	if ((pir1 & 0x20) || !(baudctl & 0x40)) { //RCIF, RCIDL
+		return 0;
+	}
+
+	intcon &= 0x7F; //Set GIE to 0; waking continues after sleep() rather than entering interrupt()
+	baudctl |= 0x02; //WUE
+	pie1 |= 0x20; //RCIE
+	intcon |= 0x40; //PEIE
+	saved_wdtcon = wdtcon;
+	clear_wdt();
+	wdtcon = LISTEN_SLEEP_WDTCON;
+
+	sleep();
+
+	wake_status = status; //Before clear_wdt(), which sets NOT_TO again
+	clear_wdt();
+	wdtcon = saved_wdtcon;
+	pie1 &= 0xDF; //RCIE
+
+	if (pir1 & 0x20) { //RCIF - RX edge
+		woke_on_rx = 1;
+		unsigned char temp = rcreg; //Clears RCIF
+		while (baudctl & 0x02) { //WUE clears itself at the next rising edge on RX
+			clear_wdt();
+		}
+	}
+	else {
+		baudctl &= 0xFD; //WUE
+		//Timer0 doesn't run during sleep; credit the slice if the WDT is what woke us
+		if ((wake_status & 0x10)==0) { //NOT_TO
+			timer0_isr_count += LISTEN_SLEEP_SLICE;
+		}
+	}
+
+	intcon |= 0x80; //Set GIE to 1 to enable interrupts globally
+	return woke_on_rx;
+}
+
 
 unsigned char ListenForResponse(const unsigned char *check, unsigned char check_len, 
 								unsigned char expected_response_len,
 								unsigned short timeout) {
 
 	//Keep writing any received values to receive buffer until timeout.
-	unsigned char i = 0;
+	unsigned char i = listen_rx_start;
+	unsigned char c, r;
+	unsigned char woke = 0;
+	unsigned char replying = 0;
+	unsigned char overflowed = 0;
 	unsigned char done_type = ISNT_DONE;
 	interval li = GetInterval(timeout); //listen interval
+	interval ri; //reply interval, from the first byte
+	unsigned short rx_tick; //when the last byte came
+	listen_cut = 0;
 	while (done_type==ISNT_DONE) {
 		
 		clear_wdt();
-	
-		//If there are any over-run errors, clear them
-		if (rcsta & 0x02) { //OERR (Bit 1)
+
+		if (replying && IntervalOver(&ri)) {
+			done_type = DONE_TIMED_OUT;
+			if ((unsigned short)(timer0_isr_count-rx_tick)<LISTEN_QUIET_GAP) {
+				listen_capped++;
+				listen_cut = 1;
+			}
+			break;
+		}
+	
+		//If there are any over-run errors, clear them
+		if (rcsta & 0x02) { //OERR (Bit 1)
 			rcsta &= 0xEF ; //Clear CREN to 0 (Bit 4)
 			rcsta |= 0x10 ; //Set CREN to 1 (Bit 4)
 		}
 
 		// Wait to receive a character
-		while(!(pir1 & 0x20) && done_type==ISNT_DONE) { //RXIF
-			clear_wdt();
-			if (li.will_wrap) {
-				if (timer0_isr_count<li.end_tick) { //wrap has happened
-					li.will_wrap = 0; //no longer anticipating wrap
+		while(!(pir1 & 0x20) && done_type==ISNT_DONE && !woke) { //RXIF
+			WaitIdle();
+			if (replying && IntervalOver(&ri)) {
+				done_type = DONE_TIMED_OUT;
+				if ((unsigned short)(timer0_isr_count-rx_tick)<LISTEN_QUIET_GAP) {
+					listen_capped++;
+					listen_cut = 1;
 				}
-			}	
-			else if (timer0_isr_count>=li.end_tick) {
+			}
+			else if (IntervalOver(&li)) {
 				done_type = DONE_TIMED_OUT;
 			}
+			else if (listen_wake_frame_length!=0 && (i%listen_wake_frame_length)==0 && 
+				(unsigned short)(timer0_isr_count-li.start_tick)+LISTEN_SLEEP_SLICE<=li.wait) {
+				woke = ListenSleep();
+			}
 		}
 
 		//Receive character. If there's space left in the software buffer, place it there;
 		//if not (or we don't want to actually save the received character) throw it away.
 		if (done_type==ISNT_DONE) {
-			if (i<RX_BUFF_LENGTH) {
-				rx_buff[i] = rcreg;
-				i++;
+			if (woke) {
+				c = listen_wake_preamble;
+				woke = 0;
+				TraceByte(TRACE_RX, c);
 			} else {
-				unsigned char temp = rcreg;
+				r = rcsta;
+				c = rcreg;
+				TraceByte(TRACE_RX, c);
+				//A corrupt byte spoils the whole reply; give up on it now rather than at the timeout
+				if (!rx_byte_ok(r, c)) {
+					done_type = DONE_RX_ERROR;
+					break;
+				}
+			}
+			if (!replying) {
+				replying = 1;
+				ri = GetInterval(listen_reply_span);
+			}
+			rx_tick = timer0_isr_count;
+			if (i<rx_buff_length) {
+				rx_buff[i] = c;
+				if (bc_check_on) {
+					BarcodeCheckByte(i, c);
+				}
+				i++;
+			}
+			else if (!overflowed) {
+				overflowed = 1;
+				listen_overflows++;
 			}
 			//Reset the intercharacter delay
 			li = GetInterval(timeout); 
 
+			if (listen_end_lead!=0 && i>=2 && rx_buff[i-2]==listen_end_lead && rx_buff[i-1]==listen_end_byte) {
+				done_type = DONE_SUCCESS;
+			}
+
 			//If we are comparing against an expected finished response...
 			if (expected_response_len!=0) {
 
@@ -851,6 +2025,34 @@ unsigned char ListenForResponse(const unsigned char *check, unsigned char check_
 	return done_type;
 }
 
+//Discards the rest of a reply the peer is still sending, until the line has been quiet for gap ms 
+//(or, with a peer that won't stop, for no longer than a reply's span).
+void DrainRx(unsigned short gap) {
+	interval qi = GetInterval(gap);
+	interval ri = GetInterval(listen_reply_span+gap);
+	while (!IntervalOver(&qi) && !IntervalOver(&ri)) {
+		WaitIdle();
+		if (pir1 & 0x20) { //RXIF
+			FlushRxHwBuffer();
+			qi = GetInterval(gap);
+		}
+	}
+}
+
+
+//Wake-up to first command latency, in ms, for the most recent wake-up. (Uninitialized, so it
+//survives an MCLR reset and can be reported from console mode.)
+unsigned short wake_tick;
+unsigned char first_cmd_pending = 0;
+unsigned short wake_to_first_cmd_ms;
+
+void NoteFirstCommand(void) {
+	if (first_cmd_pending) {
+		wake_to_first_cmd_ms = timer0_isr_count - wake_tick;
+		first_cmd_pending = 0;
+	}
+}
+
 
 //Send()
 //
@@ -877,14 +2079,17 @@ unsigned char Send(	const unsigned char * send, const unsigned char send_len,
  				   	const unsigned char * check, const unsigned char check_len, const unsigned char expected_response_len,
  					const unsigned char num_tries, const unsigned short retry_timeout ) {
 
-	unsigned char i, res;
-	i = 0;
+	unsigned char res;
+	retry_policy r;
 	res = ISNT_DONE;
 
-	for (i=0; i<num_tries; i++) {
+	NoteFirstCommand();
+
+	RetryInit(&r, num_tries, RETRY_BT_BACKOFF, RETRY_BT_MAX_BACKOFF);
+	while (RetryNext(&r)) {
 		clear_wdt();
 
-		EraseBuffer(rx_buff, RX_BUFF_LENGTH);
+		EraseBuffer(rx_buff, rx_buff_length);
 		FlushRxHwBuffer();
 
 		WriteBuff(send, send_len);
@@ -903,62 +2108,885 @@ unsigned char Send(	const unsigned char * send, const unsigned char send_len,
 }
 
 
-unsigned char ValidBarCodeJustReceived(void) {
+unsigned char PoolByte(unsigned char flags, unsigned char pos) {
+	if (flags & CMD_F_BCR) {
+		return bcr_pool[pos];
+	}
+	return bt_pool[pos];
+}
 
-	//Check length...
-	unsigned char bc_length = rx_buff[FIRST_BARCODE_STRLEN_I]-5;
-	if (bc_length==251) { //0-5 is 251
-		return 	BC_NOT_VALID_LENGTH_ZERO;	
+//RunCommand()
+//
+//Executes one record of cmd_table, with the same send/listen/check rules as Send(). Commands flagged
+//CMD_F_NO_REPLY are sent once; the function waits for the last byte to leave the shift register, then 
+//returns 1. Otherwise returns 1 once a reply passes its check, or 0 after all tries.
+//
+unsigned char RunCommand(unsigned char cmd) {
+
+	unsigned char base, flags, payload_p, payload_len, check_p, check_len, expected_len, num_tries;
+	unsigned short timeout;
+	unsigned char j, k, res;
+	retry_policy r;
+
+	base = cmd*CMD_RECORD_LENGTH;
+	flags = cmd_table[base+CMD_FLAGS_I];
+	payload_p = cmd_table[base+CMD_PAYLOAD_P_I];
+	payload_len = cmd_table[base+CMD_PAYLOAD_LENGTH_I];
+	check_p = cmd_table[base+CMD_CHECK_P_I];
+	check_len = cmd_table[base+CMD_CHECK_LENGTH_I];
+	expected_len = cmd_table[base+CMD_EXPECTED_LENGTH_I];
+	num_tries = cmd_table[base+CMD_TRIES_I];
+	timeout = cmd_table[base+CMD_TIMEOUT_I];
+	timeout *= 10;
+
+	NoteFirstCommand();
+	if (flags & CMD_F_BARCODE) {
+		BarcodeCheckStart(); //Before anything's sent, so no reply can be waiting on it
 	}
-	else if ((FIRST_BARCODE_START_I+bc_length)>=RX_BUFF_LENGTH) {
-		return BC_NOT_VALID_LENGTH_TOO_LONG;
-	}	
 
-	//Check type...
-	unsigned char type = rx_buff[FIRST_BARCODE_TYPE_I];
-	if (type==0 || type>14) {
-		return BC_NOT_VALID_TYPE;
-	}
-
-	//Check content...
-	unsigned char i;	
-	for (i=FIRST_BARCODE_START_I; (i<(bc_length+FIRST_BARCODE_START_I) && i<RX_BUFF_LENGTH); i++) {
-		if ( 	(	( 
-					   	(rx_buff[i]==45) || //'-'
-					   	(rx_buff[i]==46) || //'.'
-						((rx_buff[i]>=65) && (rx_buff[i]<=90))	|| //A-Z
-						((rx_buff[i]>=97) && (rx_buff[i]<=122)) || //a-z
-						((rx_buff[i]>=48) && (rx_buff[i]<=57))  //1-9
-					) 
- 				) == 0	) { 
-			return BC_NOT_VALID_CHARACTERS;
+	//Commands go over the wire, to the module or the reader: nothing to contend with, so a retry 
+	//doesn't back off. They do stop with the session's budget, unless they end the session.
+	RetryInit(&r, num_tries, 0, 0);
+	if (flags & CMD_F_NO_BUDGET) {
+		r.budgeted = 0;
+	}
+	while (RetryNext(&r)) {
+		clear_wdt();
+
+		EraseBuffer(rx_buff, rx_buff_length);
+		FlushRxHwBuffer();
+
+		for (j=0; j<payload_len; j++) {
+			WriteChar(PoolByte(flags, payload_p+j));
 		}
-	}	
-	return BC_VALID;
+		if (flags & CMD_F_NO_REPLY) {
+			while (!(txsta & 0x02)) { //TRMT
+				WaitIdle();
+			}
+			return 1;
+		}
+
+		//Sleep until the reply starts when its first byte is known (it stands in for the byte lost in 
+		//the wake-up); the rest of the check still has to match what really came
+		if (check_len>=2 && !(flags & CMD_F_CHECK_ANYWHERE)) {
+			listen_wake_preamble = PoolByte(flags, check_p);
+			listen_wake_frame_length = LISTEN_WAKE_FIRST_ONLY;
+		}
+		bc_check_on = (flags & CMD_F_BARCODE);
+		res = ListenForResponse(NULL, 0, expected_len, timeout);
+		bc_check_on = 0;
+		listen_wake_frame_length = 0;
+
+		//A corrupt or cut off reply may still be coming; let it go by, or its tail lands in the next 
+		//reply's rx_buff. A cut off one may still pass: its start is all that's kept anyway.
+		if (res==DONE_RX_ERROR || listen_cut) {
+			DrainRx(timeout);
+		}
+		if (res==DONE_RX_ERROR) {
+			continue;
+		}
+		//A reply of known length has to arrive in full before it's checked
+		if (expected_len!=0 && res!=DONE_SUCCESS) {
+			continue;
+		}
+		for (k=0; k==0 || (k+check_len)<=rx_buff_length; k++) {
+			for (j=0; j<check_len; j++) {
+				if (rx_buff[k+j]!=PoolByte(flags, check_p+j)) {
+					break;
+				}
+			}
+			if (j==check_len) {
+				return 1;
+			}
+			if (!(flags & CMD_F_CHECK_ANYWHERE)) {
+				break;
+			}
+		}
+	}
+
+	return 0;
 }
 
 
-unsigned char BT_AddressIsValid(const unsigned char * buff) {
+//Tries the bluetooth module at each candidate baud rate, fastest first, and keeps (and stores)
+//the first one it answers at. Assumes we're on the Bluetooth channel, in command mode.
+unsigned char CalibrateBlueToothBaud(void) {
+	unsigned char i;
+	for (i=0; i<NUM_BAUDS; i++) {
+		bt_baud = bt_baud_candidates[i];
+		SetBaud(bt_baud);
+		if (RunCommand(CMD_BT_PROMPT_ONCE)) {
+			enable_EEPROM_writes();
+			write_EEPROM_byte(bt_baud, EEPROM_BT_BAUD_POS);
+			disable_EEPROM_writes();
+			return 1;
+		}
+	}
+	bt_baud = BAUD_9600;
+	SetBaud(bt_baud);
+	return 0;
+}
 
-	unsigned char i; 
-	for (i=0; i<BT_ADDRESS_LENGTH; i++) {
-		//Testing for colons...
-		if (i==2 || i==5 || i==8 || i==11 || i==14) {
-			if (buff[i]!=58) { //58 is ':'
-				return 0;
+//Sweeps osctune, pinging the barcode reader at each setting, and keeps (and stores) the middle 
+//of the range of settings that work. Assumes we're on the wired channel, with the reader awake.
+unsigned char CalibrateOscTune(void) {
+	signed char t, first_ok, last_ok;
+	first_ok = OSCTUNE_MAX_TRIM+1;
+	last_ok = OSCTUNE_MAX_TRIM+1;
+	for (t=OSCTUNE_MIN_TRIM; t<=OSCTUNE_MAX_TRIM; t++) {
+		osctune = t & 0x1F; //5-bit two's complement
+		if (RunCommand(CMD_BCR_PING)) {
+			if (first_ok>OSCTUNE_MAX_TRIM) {
+				first_ok = t;
+			}
+			last_ok = t;
+		}
+	}
+	if (first_ok>OSCTUNE_MAX_TRIM) {
+		osctune = 0x00; //middle frequency
+		return 0;
+	}
+	t = (first_ok+last_ok)/2;
+	osctune = t & 0x1F;
+	enable_EEPROM_writes();
+	write_EEPROM_byte(osctune, EEPROM_OSCTUNE_POS);
+	disable_EEPROM_writes();
+	return 1;
+}
+
+
+//Restores the barcode reader's defaults and customizes them, and records (which version of) them
+//as applied. The reader's settings can't be read back, so the record stands in for a read-back.
+unsigned char ApplyBarcodeReaderDefaults(void) {
+	unsigned char ok;
+	ok = RunCommand(CMD_BCR_RESTORE_DEFAULTS);
+	if (!RunCommand(CMD_BCR_CUSTOMIZE_DEFAULTS)) {
+		ok = 0;
+	}
+	enable_EEPROM_writes();
+	write_EEPROM_byte(ok ? BCR_DEFAULTS_VERSION : EEPROM_NOT_SET, EEPROM_BCR_DEFAULTS_POS);
+	disable_EEPROM_writes();
+	return ok;
+}
+
+
+//RunSequence()
+//
+//Executes a SEQ_END-terminated list of commands and steps from program memory. Returns 1 if every 
+//counted command succeeded, 0 otherwise. Commands are all attempted, whether or not earlier ones failed.
+//
+unsigned char RunSequence(rom char * seq) {
+
+	unsigned char i, step, ok, all_ok;
+	all_ok = 1;
+
+	for (i=0; ; i++) {
+		clear_wdt();
+		step = seq[i];
+
+		if (step==SEQ_END) {
+			break;
+		}
+		else if (step==SEQ_ENTER_BT_CMD_MODE) {
+			EnterBTCommandMode();
+		}
+		else if (step==SEQ_EXIT_BT_CMD_MODE) {
+			ExitBTCommandMode();
+		}
+		else if (step==SEQ_SELECT_BT) {
+			SerialSelectBlueTooth();
+		}
+		else if (step==SEQ_SELECT_WIRED) {
+			SerialSelectWired();
+		}
+		else if (step==SEQ_WAKE_BCR) {
+			ms_delay(BCR_BUTTON_RELEASE_TO_BCR_WAKEUP_DELAY);
+			SetHIto(1); //Wakes barcode reader
+			ms_delay(BCR_WAKEUP_TO_INTERROGATE_DELAY);
+		}
+		else if (step==SEQ_BCR_DR_DELAY) {
+			ms_delay(INTERROGATE_TO_DR_READY_DELAY);
+		}
+		else if (step==SEQ_RELEASE_BCR) {
+			SetHIto(0);
+		}
+		else if (step==SEQ_CALIBRATE_BT_BAUD) {
+			if (!CalibrateBlueToothBaud()) {
+				all_ok = 0;
+			}
+		}
+		else if (step==SEQ_PROBE_BT_BAUD) {
+			if (!RunCommand(CMD_BT_PROMPT_ONCE) && !CalibrateBlueToothBaud()) {
+				all_ok = 0;
+			}
+		}
+		else if (step==SEQ_CALIBRATE_OSCTUNE) {
+			if (!CalibrateOscTune()) {
+				all_ok = 0;
+			}
+		}
+		else if (step==SEQ_ENSURE_BT_BAUD) {
+			if (bt_baud!=bt_baud_candidates[0] || read_EEPROM_byte(EEPROM_BT_BAUD_POS)==EEPROM_NOT_SET) {
+				RunCommand(CMD_BT_SET_BAUD);
+				if (!CalibrateBlueToothBaud()) {
+					all_ok = 0;
+				}
+			}
+		}
+		else if (step==SEQ_ENSURE_OSCTUNE) {
+			if (read_EEPROM_byte(EEPROM_OSCTUNE_POS)==EEPROM_NOT_SET && !CalibrateOscTune()) {
+				all_ok = 0;
+			}
+		}
+		else if (step==SEQ_APPLY_BCR_DEFAULTS || step==SEQ_ENSURE_BCR_DEFAULTS) {
+			if (step==SEQ_APPLY_BCR_DEFAULTS || read_EEPROM_byte(EEPROM_BCR_DEFAULTS_POS)!=BCR_DEFAULTS_VERSION) {
+				if (!ApplyBarcodeReaderDefaults()) {
+					all_ok = 0;
+				}
 			}
 		}
-		//Testing for 0-9/A-F/a-f
 		else {
-			if ( (buff[i]<48) || ((buff[i]>57)&&(buff[i]<65)) || ((buff[i]>70)&&(buff[i]<97)) || (buff[i]>102) ) { 
-				return 0;
+			ok = RunCommand(step);
+			if (cmd_table[step*CMD_RECORD_LENGTH+CMD_FLAGS_I] & CMD_F_OR_NEXT) {
+				if (!ok) {
+					i++;
+					ok = RunCommand(seq[i]);
+				} else {
+					i++; //Skip the alternative
+				}
+			}
+			if (!ok && !(cmd_table[seq[i]*CMD_RECORD_LENGTH+CMD_FLAGS_I] & CMD_F_UNCOUNTED)) {
+				all_ok = 0;
 			}
 		}
 	}
 
+	return all_ok;
+}
+
+
+unsigned char crc8_update(unsigned char crc, unsigned char b) {
+	unsigned char i;
+	crc ^= b;
+	for (i=0; i<8; i++) {
+		if (crc & 0x80) {
+			crc = (crc<<1) ^ 0x07;
+		} else {
+			crc <<= 1;
+		}
+	}
+	return crc;
+}
+
+
+//Duplicate-scan suppression
+//Each barcode accepted from the reader is remembered (as its length and two hashes) for a while. A 
+//repeat inside that time is dropped rather than queued, so it costs neither a connection nor the 
+//phone's attention. One that's dropped undelivered (no room in the queue) is forgotten again.
+//Entries age by coarse_s; while any is live, the WDT keeps a ~1 sec slice running through sleep 
+//to advance it.
+#define DUP_CACHE_SIZE 4
+#define DUP_TTL_DEFAULT 10 //Seconds, if EEPROM_DUP_TTL_POS isn't set
+#define DUP_SLEEP_WDTCON 0x07 //WDTPS 0011 (1:256) and SWDTEN; with the 1:128 OPTION postscaler, ~1.06 sec
+#define DUP_SLEEP_SLICE_S 1
+
+typedef struct {
+	unsigned char length; //0 - empty
+	unsigned char crc;
+	unsigned char sum;
+	unsigned short stamp; //coarse_s when it was scanned
+} dup_entry;
+dup_entry dup_cache[DUP_CACHE_SIZE];
+unsigned short dup_suppressed; //Not initialized, so it can be reported after a reset
+
+unsigned char DupTTL(void) {
+	unsigned char ttl = read_EEPROM_byte(EEPROM_DUP_TTL_POS);
+	if (ttl==EEPROM_NOT_SET) {
+		return DUP_TTL_DEFAULT;
+	}
+	return ttl;
+}
+
+void DupCacheInit(void) {
+	unsigned char k;
+	for (k=0; k<DUP_CACHE_SIZE; k++) {
+		dup_cache[k].length = 0;
+	}
+}
+
+//Empties expired entries. Returns the number still live.
+unsigned char DupCacheExpire(void) {
+	unsigned char k, ttl, live;
+	ttl = DupTTL();
+	live = 0;
+	for (k=0; k<DUP_CACHE_SIZE; k++) {
+		if (dup_cache[k].length!=0) {
+			if ((unsigned short)(coarse_s-dup_cache[k].stamp)>=ttl) {
+				dup_cache[k].length = 0;
+			} else {
+				live++;
+			}
+		}
+	}
+	return live;
+}
+
+unsigned char dup_crc, dup_sum; //Of the barcode last hashed by DupHash()
+
+void DupHash(unsigned char offset, unsigned char length) {
+	unsigned char i;
+	dup_crc = 0;
+	dup_sum = 0;
+	for (i=0; i<length; i++) {
+		dup_crc = crc8_update(dup_crc, arena[offset+i]);
+		dup_sum += arena[offset+i];
+	}
+}
+
+//Returns 1 if the barcode at arena[offset] repeats a live entry (and counts it); otherwise 
+//remembers it, in place of an empty or the oldest entry, and returns 0.
+unsigned char DupCacheSuppress(unsigned char offset, unsigned char length) {
+	unsigned char k, oldest;
+
+	DupHash(offset, length);
+	DupCacheExpire();
+	oldest = 0;
+	for (k=0; k<DUP_CACHE_SIZE; k++) {
+		if (dup_cache[k].length==length && dup_cache[k].crc==dup_crc && dup_cache[k].sum==dup_sum) {
+			dup_suppressed++;
+			return 1;
+		}
+		if (dup_cache[oldest].length!=0 && (dup_cache[k].length==0 || 
+			(unsigned short)(coarse_s-dup_cache[k].stamp)>(unsigned short)(coarse_s-dup_cache[oldest].stamp))) {
+			oldest = k;
+		}
+	}
+
+	dup_cache[oldest].length = length;
+	dup_cache[oldest].crc = dup_crc;
+	dup_cache[oldest].sum = dup_sum;
+	dup_cache[oldest].stamp = coarse_s;
+	return 0;
+}
+
+//Forgets the barcode at arena[offset]: it was dropped undelivered, so a rescan has to get through
+void DupCacheForget(unsigned char offset, unsigned char length) {
+	unsigned char k;
+
+	DupHash(offset, length);
+	for (k=0; k<DUP_CACHE_SIZE; k++) {
+		if (dup_cache[k].length==length && dup_cache[k].crc==dup_crc && dup_cache[k].sum==dup_sum) {
+			dup_cache[k].length = 0;
+		}
+	}
+}
+
+
+//Moves the held barcode into the queue. Returns 0, leaving it held, if there's no room.
+unsigned char QueueHeldBarcode(void) {
+	unsigned char * q;
+	if ( (bc_queue_used+BC_RECORD_HEADER_LENGTH+barcode_view.length)>BC_QUEUE_LENGTH ) {
+		return 0;
+	}
+	q = bc_queue+bc_queue_used;
+	q[BC_RECORD_LENGTH_I] = barcode_view.length;
+	q[BC_RECORD_SEQ_I] = barcode_view.seq;
+	copy_buffer_from_to(arena+barcode_view.offset, q+BC_RECORD_HEADER_LENGTH, barcode_view.length);
+	bc_queue_used += BC_RECORD_HEADER_LENGTH+barcode_view.length;
+	ArenaReleaseBarcode();
 	return 1;
 }
 
+unsigned char NumQueued(void) {
+	unsigned char pos, n;
+	n = 0;
+	for (pos=0; pos<bc_queue_used; pos+=(BC_RECORD_HEADER_LENGTH+bc_queue[pos+BC_RECORD_LENGTH_I])) {
+		n++;
+	}
+	return n;
+}
+
+//Frames go out oldest first: the queued records, then the held barcode (if any)
+unsigned char PendingFrames(void) {
+	unsigned char n = NumQueued();
+	if (barcode_view.length!=0) {
+		n++;
+	}
+	return n;
+}
+
+void FrameView(unsigned char k, bc_view * f) {
+	unsigned char pos;
+	for (pos=0; pos<bc_queue_used; pos+=(BC_RECORD_HEADER_LENGTH+bc_queue[pos+BC_RECORD_LENGTH_I])) {
+		if (k==0) {
+			f->offset = ARENA_QUEUE_OFFSET+pos+BC_RECORD_HEADER_LENGTH;
+			f->length = bc_queue[pos+BC_RECORD_LENGTH_I];
+			f->seq = bc_queue[pos+BC_RECORD_SEQ_I];
+			return;
+		}
+		k--;
+	}
+	f->offset = barcode_view.offset;
+	f->length = barcode_view.length;
+	f->seq = barcode_view.seq;
+}
+
+//Moves whatever has been received into rx_buff at listen_rx_start, for the listen that follows. 
+//The EUSART only holds 2 bytes, so while a window of frames goes out (the phone acknowledging the 
+//first ones meanwhile) this has to run once per byte sent, or acknowledgments are lost to an overrun.
+void CollectRx(void) {
+	unsigned char c;
+	if (rcsta & 0x02) { //OERR (Bit 1)
+		rcsta &= 0xEF ; //Clear CREN to 0 (Bit 4)
+		rcsta |= 0x10 ; //Set CREN to 1 (Bit 4)
+	}
+	while (pir1 & 0x20) { //RXIF
+		c = rcreg;
+		TraceByte(TRACE_RX, c);
+		if (listen_rx_start<rx_buff_length) {
+			rx_buff[listen_rx_start++] = c;
+		}
+	}
+}
+
+//Start, length, sequence number, bytes, crc; collecting what's come in after each
+void WriteFrame(bc_view * f) {
+	unsigned char i, c, crc;
+	clear_wdt();
+	crc = 0;
+	for (i=0; i<f->length+BT_FRAME_OVERHEAD; i++) {
+		if (i==0) {
+			c = BT_FRAME_START;
+		} else if (i==1) {
+			c = f->length;
+		} else if (i==2) {
+			c = f->seq;
+		} else if (i<f->length+3) {
+			c = arena[f->offset+i-3];
+		} else {
+			c = crc;
+		}
+		WriteChar(c);
+		if (i!=0) {
+			crc = crc8_update(crc, c);
+		}
+		CollectRx();
+	}
+}
+
+//The frame after the newest one of base..next-1 acknowledged in rx_buff, or base if none is
+unsigned char NewestAck(unsigned char base, unsigned char next) {
+	unsigned char acked, i, k;
+	bc_view f;
+
+	acked = base;
+	i = 0;
+	while ((i+1)<rx_buff_length) {
+		if (rx_buff[i]==BT_ACK_FRAME_START) {
+			for (k=acked; k<next; k++) {
+				FrameView(k, &f);
+				if (f.seq==rx_buff[i+1]) {
+					acked = k+1;
+					break;
+				}
+			}
+			i+=2; //'$', sequence number
+		} else {
+			i++;
+		}
+	}
+	return acked;
+}
+
+//DeliverPending()
+//
+//Sends the pending frames over an established connection, up to BT_SEND_WINDOW at a time, and 
+//collects the phone's cumulative acknowledgments, the first ones while the rest of the window is
+//still going out; a round is over once the last frame sent is acknowledged. After a round with no new acknowledgment, it goes 
+//back (after a backoff) and resends from the oldest unacknowledged frame; after NUM_BT_SEND_TRIES such 
+//rounds in a row, or when the session's budget runs out, it gives up. Returns the number of frames 
+//acknowledged, oldest first.
+//
+unsigned char DeliverPending(void) {
+
+	unsigned char n, base, next, acked;
+	bc_view f;
+	retry_policy r;
+
+	n = PendingFrames();
+	base = next = 0;
+
+	//Each round is an attempt; progress starts the count (and the backoff) over
+	RetryInit(&r, NUM_BT_SEND_TRIES, RETRY_BT_BACKOFF, RETRY_BT_MAX_BACKOFF);
+	while (base<n && RetryNext(&r)) {
+		clear_wdt();
+
+		EraseBuffer(rx_buff, rx_buff_length);
+		FlushRxHwBuffer();
+		listen_rx_start = 0;
+
+		//Fill the window, collecting acknowledgments as they come
+		while (next<n && (next-base)<BT_SEND_WINDOW) {
+			FrameView(next, &f);
+			WriteFrame(&f);
+			next++;
+		}
+		CollectRx();
+
+		//Unless the last frame is already acknowledged, listen until it is, or the phone goes 
+		//quiet; sleeping between acknowledgments
+		acked = NewestAck(base, next);
+		if (acked!=next) {
+			FrameView(next-1, &f);
+			listen_end_lead = BT_ACK_FRAME_START;
+			listen_end_byte = f.seq;
+			listen_wake_preamble = BT_ACK_PREAMBLE;
+			listen_wake_frame_length = BT_ACK_FRAME_LENGTH;
+			listen_reply_span = BT_ACK_REPLY_SPAN;
+			ListenForResponse(NULL, 0, 0, MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY);
+			listen_wake_frame_length = 0;
+			listen_reply_span = LISTEN_REPLY_SPAN;
+			listen_end_lead = 0;
+			acked = NewestAck(base, next);
+		}
+		listen_rx_start = 0;
+
+		if (acked==base) { //No progress; go back
+			next = base;
+		} else {
+			base = acked;
+			RetryInit(&r, NUM_BT_SEND_TRIES, RETRY_BT_BACKOFF, RETRY_BT_MAX_BACKOFF);
+		}
+	}
+
+	return base;
+}
+
+//Drops the first num_acked pending frames. If the held barcode wasn't acknowledged, it is
+//queued for the next connection, or dropped if there's no room.
+void RetirePending(unsigned char num_acked) {
+
+	unsigned char num_queued, pos, i;
+
+	num_queued = NumQueued();
+	if (num_acked>=num_queued) {
+		bc_queue_used = 0;
+		if (num_acked>num_queued) {
+			ArenaReleaseBarcode();
+		}
+	} 
+	else {
+		for (pos=0; num_acked>0; num_acked--) {
+			pos += BC_RECORD_HEADER_LENGTH+bc_queue[pos+BC_RECORD_LENGTH_I];
+		}
+		for (i=0; (pos+i)<bc_queue_used; i++) {
+			bc_queue[i] = bc_queue[pos+i];
+		}
+		bc_queue_used -= pos;
+	}
+
+	if (barcode_view.length!=0 && !QueueHeldBarcode()) {
+		DupCacheForget(barcode_view.offset, barcode_view.length);
+		ArenaReleaseBarcode();
+	}
+}
+
+
+//Checkpoint
+//The state machine's progress is checkpointed in RAM that isn't initialized at startup (like the
+//arena, which holds the barcodes themselves), so it survives a watchdog reset. On a watchdog reset,
+//main() resumes the interrupted delivery from it rather than taking the cold-start path.
+#define CHECKPOINT_MAGIC 0xA5
+#define MAX_WDT_RESUMES 2 //In a row, without getting back to sleep; then start cold
+
+typedef struct {
+	unsigned char magic;
+	unsigned char state;
+	unsigned char queue_used;
+	unsigned char tx_seq;
+	unsigned char view_offset;
+	unsigned char view_length;
+	unsigned char view_seq;
+	unsigned char resumes; //Watchdog resumes in a row
+	unsigned char check; //Sum of the above, inverted
+} checkpoint_t;
+checkpoint_t checkpoint; //Not initialized, on purpose
+
+unsigned char CheckpointSum(void) {
+	unsigned char i, sum;
+	unsigned char * p = (unsigned char *)&checkpoint;
+	sum = 0;
+	for (i=0; i<(sizeof(checkpoint_t)-1); i++) {
+		sum += p[i];
+	}
+	return ~sum;
+}
+
+void Checkpoint(unsigned char state) {
+	checkpoint.magic = CHECKPOINT_MAGIC;
+	checkpoint.state = state;
+	checkpoint.queue_used = bc_queue_used;
+	checkpoint.tx_seq = tx_seq;
+	checkpoint.view_offset = barcode_view.offset;
+	checkpoint.view_length = barcode_view.length;
+	checkpoint.view_seq = barcode_view.seq;
+	if (state==STATE_ASLEEP_SECONDARY_POWER_OFF) {
+		checkpoint.resumes = 0;
+	}
+	checkpoint.check = CheckpointSum();
+}
+
+//Restores the queue and held barcode from a valid checkpoint, and returns the state to resume in;
+//or returns STATE_INITIAL if there's nothing (valid) to resume.
+unsigned char RestoreCheckpoint(void) {
+	if (checkpoint.magic!=CHECKPOINT_MAGIC || checkpoint.check!=CheckpointSum() || 
+		checkpoint.resumes>=MAX_WDT_RESUMES || checkpoint.queue_used>BC_QUEUE_LENGTH ||
+		checkpoint.view_length>MAX_BARCODE_LENGTH) {
+		return STATE_INITIAL;
+	}
+	checkpoint.resumes++;
+
+	bc_queue_used = checkpoint.queue_used;
+	tx_seq = checkpoint.tx_seq;
+	ArenaReleaseBarcode();
+	if (checkpoint.view_length!=0) {
+		ArenaHoldBarcode(checkpoint.view_offset, checkpoint.view_length);
+		barcode_view.seq = checkpoint.view_seq;
+		tx_seq = checkpoint.tx_seq;
+	}
+
+	if (PendingFrames()!=0) {
+		return STATE_SENDING_BARCODE_OVER_BLUETOOTH;
+	}
+	if (checkpoint.state==STATE_GETTING_BARCODE_FROM_READER) {
+		return STATE_GETTING_BARCODE_FROM_READER; //The reader hadn't been cleared yet
+	}
+	return STATE_INITIAL;
+}
+
+
+//Barcode Packing
+//Held, queued and sent barcodes are packed: a type byte (the CS-1504's symbology), a byte of 
+//encoding (top 2 bits) and character count (low 6), then the characters in the tightest encoding 
+//they all fit:
+//	BC_ENC_BCD 		digits only; two per byte, high nibble first, an odd count padded with 0xF
+//	BC_ENC_SIXBIT 	0-9 A-Z a-z - . (values 0-9, 10-35, 36-61, 62, 63); packed msb first, 4 per 3 bytes, 
+//					the last byte zero-padded
+//	BC_ENC_ASCII 	anything else; one byte each
+#define BC_ENC_ASCII 0x00
+#define BC_ENC_BCD 0x40
+#define BC_ENC_SIXBIT 0x80
+#define BC_PACKED_HEADER_LENGTH 2
+
+//0xFF if c isn't in the six-bit set
+unsigned char SixBitValue(unsigned char c) {
+	if (c>=48 && c<=57) { //0-9
+		return c-48;
+	}
+	if (c>=65 && c<=90) { //A-Z
+		return c-55;
+	}
+	if (c>=97 && c<=122) { //a-z
+		return c-61;
+	}
+	if (c==45) { //'-'
+		return 62;
+	}
+	if (c==46) { //'.'
+		return 63;
+	}
+	return 0xFF;
+}
+
+//Packs the first barcode of an upload (its n characters) in place, and moves the packed record back 
+//to where the characters started, so the rx window in front of it doesn't shrink. Returns its length.
+unsigned char PackBarcode(unsigned char n) {
+	unsigned char * bc = rx_buff+FIRST_BARCODE_START_I;
+	unsigned char i, j, c, enc, nbits;
+	unsigned short acc;
+
+	enc = BC_ENC_BCD;
+	for (i=0; i<n; i++) {
+		c = bc[i];
+		if (c<48 || c>57) {
+			enc = BC_ENC_SIXBIT;
+		}
+		if (SixBitValue(c)==0xFF) {
+			enc = BC_ENC_ASCII;
+			break;
+		}
+	}
+
+	//The header replaces the upload's length and type bytes, just in front of the characters
+	rx_buff[FIRST_BARCODE_STRLEN_I] = rx_buff[FIRST_BARCODE_TYPE_I];
+	rx_buff[FIRST_BARCODE_TYPE_I] = enc|n;
+
+	//Packed bytes never get ahead of the characters they're packed from
+	j = 0;
+	if (enc==BC_ENC_BCD) {
+		for (i=0; i<n; i+=2) {
+			c = (bc[i]-48)<<4;
+			if ((i+1)<n) {
+				c |= (bc[i+1]-48);
+			} else {
+				c |= 0x0F;
+			}
+			bc[j++] = c;
+		}
+	}
+	else if (enc==BC_ENC_SIXBIT) {
+		acc = 0;
+		nbits = 0;
+		for (i=0; i<n; i++) {
+			acc = (acc<<6) | SixBitValue(bc[i]);
+			nbits += 6;
+			if (nbits>=8) {
+				nbits -= 8;
+				bc[j++] = acc>>nbits;
+				acc &= ((1<<nbits)-1);
+			}
+		}
+		if (nbits!=0) {
+			bc[j++] = acc<<(8-nbits);
+		}
+	}
+	else {
+		j = n;
+	}
+	j += BC_PACKED_HEADER_LENGTH;
+
+	for (i=j; i>0; i--) {
+		bc[i-1] = rx_buff[FIRST_BARCODE_STRLEN_I+i-1];
+	}
+	return j;
+}
+
+
+//Verdict on the first barcode of the last upload, reached as it was received. It's only BC_VALID
+//once every byte up to the barcode's last has arrived and been checked.
+unsigned char ValidBarCodeJustReceived(void) {
+	return bc_check.verdict;
+}
+
+
+unsigned char BT_AddressCharIsValid(unsigned char c, unsigned char i) {
+	//Testing for colons...
+	if (i==2 || i==5 || i==8 || i==11 || i==14) {
+		return (c==58); //58 is ':'
+	}
+	//Testing for 0-9/A-F/a-f
+	if ( (c<48) || ((c>57)&&(c<65)) || ((c>70)&&(c<97)) || (c>102) ) { 
+		return 0;
+	}
+	return 1;
+}
+
+unsigned char BT_AddressIsValid(const unsigned char * buff) {
+
+	unsigned char i; 
+	for (i=0; i<BT_ADDRESS_LENGTH; i++) {
+		if (!BT_AddressCharIsValid(buff[i], i)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//Same check, straight from an address stored in EEPROM
+unsigned char BT_StoredAddressIsValid(unsigned char pos) {
+
+	unsigned char i; 
+	for (i=0; i<BT_ADDRESS_LENGTH; i++) {
+		if (!BT_AddressCharIsValid(read_EEPROM_byte(pos+i), i)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+unsigned char BT_StoredAddressEquals(unsigned char pos, const unsigned char * buff) {
+
+	unsigned char i; 
+	for (i=0; i<BT_ADDRESS_LENGTH; i++) {
+		if (read_EEPROM_byte(pos+i)!=buff[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+//Peers
+unsigned char PeerPos(unsigned char slot) {
+	if (slot==0) {
+		return 0;
+	}
+	return EEPROM_PEER_1_POS+(slot-1)*BT_PEER_SLOT_LENGTH;
+}
+
+unsigned char PeerOrder(void) {
+	unsigned char order = read_EEPROM_byte(EEPROM_PEER_ORDER_POS);
+	if (order==EEPROM_NOT_SET) {
+		return PEER_ORDER_DEFAULT;
+	}
+	return order;
+}
+
+//Slot number at a rank of the order
+unsigned char PeerAt(unsigned char order, unsigned char rank) {
+	return (order>>(rank<<1)) & 0x03;
+}
+
+//Moves a slot to the front of the stored order, keeping the others as they were
+void PromotePeer(unsigned char slot) {
+	unsigned char order, new_order, rank, s, shift;
+
+	order = PeerOrder();
+	new_order = slot;
+	shift = 2;
+	for (rank=0; rank<NUM_BT_PEERS; rank++) {
+		s = PeerAt(order, rank);
+		if (s!=slot && shift<(NUM_BT_PEERS<<1)) {
+			new_order |= (s<<shift);
+			shift += 2;
+		}
+	}
+
+	if (new_order!=order) { //Spare the EEPROM when the same phone keeps answering
+		enable_EEPROM_writes();
+		write_EEPROM_byte(new_order, EEPROM_PEER_ORDER_POS);
+		disable_EEPROM_writes();
+	}
+}
+
+//Slot for a phone about to be learned: an empty one, else the one least recently connected to
+unsigned char PeerSlotForNew(void) {
+	unsigned char order, rank, slot;
+
+	order = PeerOrder();
+	for (rank=0; rank<NUM_BT_PEERS; rank++) {
+		slot = PeerAt(order, rank);
+		if (!BT_StoredAddressIsValid(PeerPos(slot))) {
+			return slot;
+		}
+	}
+	return PeerAt(order, NUM_BT_PEERS-1);
+}
+
+//Slot of the stored peer with this address, or NUM_BT_PEERS if there's none
+unsigned char PeerSlotOf(const unsigned char * buff) {
+	unsigned char slot;
+	for (slot=0; slot<NUM_BT_PEERS; slot++) {
+		if (BT_StoredAddressEquals(PeerPos(slot), buff)) {
+			break;
+		}
+	}
+	return slot;
+}
+
 
 void PrintBarCodeInRx(void) {
 
@@ -982,6 +3010,15 @@ void PrintBarCodeInRx(void) {
 		case BC_NOT_VALID_CHARACTERS: {
 			WriteStr("Non # chars\r");
 		}
+		case BC_NOT_VALID_CHECK_DIGIT: {
+			WriteStr("Bad check digit.\r");
+		}
+		case BC_NOT_ALLOWED_TYPE: {
+			WriteStr("Type not allowed.\r");
+		}
+		case BC_NOT_VALID_INCOMPLETE: {
+			WriteStr("Cut short.\r");
+		}
 		case BC_VALID: {
 
 			unsigned char bc_length = rx_buff[FIRST_BARCODE_STRLEN_I]-5;
@@ -989,9 +3026,9 @@ void PrintBarCodeInRx(void) {
 			//Print Bar Code's Digits
 			unsigned char i;
 			for (i=FIRST_BARCODE_START_I; 
-					(i<(FIRST_BARCODE_START_I+bc_length) && i<BARCODE_BUFF_LENGTH); i++) {
+					(i<(FIRST_BARCODE_START_I+bc_length) && i<RX_BUFF_LENGTH); i++) {
 				WriteChar(' ');
-				WriteChar(barcode_buff[i]);
+				WriteChar(rx_buff[i]);
 			}
 		}
 		default: {
@@ -1009,11 +3046,14 @@ void InitializeEverything(void) {
 	InitTimer0(); //Do first; all delays depend on timer0
 
 	query_bcr_f = 0;
+	bc_check_on = 0;
+	trace.on = 0;
+	trace.stopped = 0;
+	trace.used = 0;
+	trace.n = 0;
 	InitBCRButton();
 	EnableBcrButtonInterrupt();
 
-	InitSecondaryPower();
-
 	Init_HI_DR();
 	//NOTE: Setting HI to 0 is best here for barcode reader coms.
 	//It impacts serial coms with the PC however. When the switches are thrown
@@ -1029,91 +3069,398 @@ void InitializeEverything(void) {
 }
 
 
+//Sleep configuration and fast resume
+//SuspendForSleep() saves exactly the registers the low power configuration changes, and 
+//ResumeFromSleep() puts just those back, instead of going through InitializeEverything(). 
+//Secondary power is left out of both; it may be warmed up during a button press.
+unsigned char saved_porta, saved_trisa, saved_portc, saved_txsta, saved_rcsta;
+
+void SuspendForSleep(void) {
+
+	saved_porta = porta;
+	saved_trisa = trisa;
+	saved_portc = portc;
+	saved_txsta = txsta;
+	saved_rcsta = rcsta;
+
+	//Configure  Pins for Low Power
+	//++++++++++++++++
+	//Pin 1 - Vdd. Do nothing
+		
+	//Pin 2 - Btn/BtBreak. Both connect to weak pullups, so we
+	//set this to a high output
+	porta |= 0x20; //Set Pin 2 to 1
+	trisa &= 0xDF; //Configure Pin 2 as output; (TRISA5 to 0)
+
+	//Pin 3 - "HostInput" (an output from uP). Make sure it is low
+	SetHIto(1); //Setting to 1 puts output low
+
+	//Pin 4 - _MCLR. A necessary input
+	
+	//Pin 5 - Rx 
+	//Do nothing for now
+
+	//Pin 6 - Tx. (C4). Configure as a low digital output
+	portc &= 0xEF; //Set Pin 6 (C4) low 
+	trisc &= 0xEF; //Set Pin 6 (C4) to output; (TRISC4 = 0)
+
+	//Disable UART
+	txsta &= 0xDF; //Clear TXEN (bit 5) 
+	rcsta &= 0x6F; //Clear CREN (bit4) and SPEN (7)
+
+	//Pin 7 - Select. Already a digital output. Set to 0.
+	portc &= 0xF7;  //Set C3 (Pin 7) to 0
+
+	//Pin 8 - Already an output (low). Its turning secondary power off
+
+	//Pin 9 - DR.
+	// Do nothing for now
+
+	//Pin 10 - LED output. Set low.
+	TurnLEDoff(); 
+
+	//Pin 11 (RA2) - READ_BEGUN. A necessary input
+
+	//Pin 12 - (RA1) ICSP Clk. Set as low digital output
+	porta &= 0xFD; //Set A1 to 0
+	trisa &= 0xFD; //Configure A1 as output; (TRISA1 to 0)
+
+	//Pin 13 - ICSP Data (RA0). Set as low digital output
+	porta &= 0xFE; //Set A0 to 0
+	trisa &= 0xFE; //Configure A0 as output; (TRISA0 to 0)
+
+	//Pin 14 - Vss. Do nothing
+	//----------------
+}
+
+void ResumeFromSleep(void) {
+	//Pins 2, 3, 12, 13: RA5, RA4, RA1, RA0
+	porta = (porta & 0xCC) | (saved_porta & 0x33);
+	trisa = saved_trisa;
+	//Pins 6, 7, 10: C4, C3, C0. (Not C2; secondary power)
+	portc = (portc & 0xE6) | (saved_portc & 0x19);
+	//UART
+	txsta = saved_txsta;
+	rcsta = saved_rcsta;
+	FlushRxHwBuffer();
+
+	query_bcr_f = 0;
+	EnableBcrButtonInterrupt();
+}
+
+
+void WriteHexShort(unsigned short v) {
+	b2str_buff(v>>8);
+	WriteStr(str_buff);
+	b2str_buff(v&0xFF);
+	if (str_buff[1]=='\0') {
+		WriteChar('0');
+	}
+	WriteStr(str_buff);
+}
+
+//Starts tracing a session, if armed
+void TraceStart(void) {
+	unsigned char len;
+	if (trace.on || read_EEPROM_byte(EEPROM_TRACE_STATE_POS)!=TRACE_ARMED) {
+		return;
+	}
+	len = read_EEPROM_byte(EEPROM_TRACE_LENGTH_POS);
+	if (len>EEPROM_TRACE_LENGTH-TRACE_TRAILER_LENGTH) {
+		return;
+	}
+	trace.length = len;
+	trace.pos = EEPROM_TRACE_POS+len;
+	trace.head = 0;
+	trace.used = 0;
+	trace.n = 0;
+	trace.stopped = 0;
+	trace.last = timer0_isr_count;
+	TraceStage(0x00); //Session start: an empty run
+	TraceStage(0x00);
+	trace.on = 1;
+}
+
+//Ends the session's trace: closes the run, writes out the stage, and records the length
+void TraceStop(void) {
+	if (!trace.on && !trace.stopped) {
+		return;
+	}
+	TraceEndRun();
+	trace.on = 0;
+	while (trace.used!=0) {
+		clear_wdt();
+		TraceService();
+	}
+	enable_EEPROM_writes();
+	write_EEPROM_byte(trace.length, EEPROM_TRACE_LENGTH_POS);
+	if (trace.stopped) {
+		write_EEPROM_byte(TRACE_STOPPED, EEPROM_TRACE_STATE_POS);
+	}
+	disable_EEPROM_writes();
+	trace.stopped = 0;
+}
+
+//Console "cap": arms a new trace
+void TraceArm(void) {
+	enable_EEPROM_writes();
+	write_EEPROM_byte(0, EEPROM_TRACE_LENGTH_POS);
+	write_EEPROM_byte(TRACE_ARMED, EEPROM_TRACE_STATE_POS);
+	disable_EEPROM_writes();
+	WriteStr("\n\rTrace armed");
+}
+
+//Console "dump": length and state, then the trace in hex
+void TraceDump(void) {
+	unsigned char len, i, b;
+	len = read_EEPROM_byte(EEPROM_TRACE_LENGTH_POS);
+	if (len>EEPROM_TRACE_LENGTH) {
+		len = 0;
+	}
+	WriteStr("\n\rTrace: 0x");
+	WriteHexShort(len);
+	WriteStr(" 0x");
+	WriteHexShort(read_EEPROM_byte(EEPROM_TRACE_STATE_POS));
+	for (i=0; i<len; i++) {
+		if ((i&0x0F)==0) {
+			WriteStr("\n\r");
+		}
+		b = read_EEPROM_byte(EEPROM_TRACE_POS+i);
+		if (b<16) { //leading zero
+			WriteChar('0');
+		}
+		b2str_buff(b);
+		WriteStr(str_buff);
+	}
+}
+
+//Console Bridge
+//Bytes go between the PC and the bluetooth module through two ring buffers laid over the arena (the
+//queue is empty in this mode: it's only reached from a cold start). There's one EUSART behind the mux,
+//so the bridge can only hear one side at a time. It stays on the PC until a line ends (or the PC ring 
+//fills), hops over to forward it, streams the module's reply into the BT ring until the module goes 
+//quiet, then hops back and drains it. A hop waits for the last byte to leave and settles for a couple
+//of ms, rather than SerialSelect*()'s 60. Input pasted faster than a line at a time should be paced 
+//by the terminal (e.g. wait for '>').
+#define BRIDGE_PC_RING_LENGTH 16
+#define BRIDGE_BT_RING_LENGTH (RX_BUFF_LENGTH+BC_QUEUE_LENGTH-BRIDGE_PC_RING_LENGTH) //Holds "lst trusted" with NUM_BT_PEERS
+#define BRIDGE_SETTLE_DELAY 2
+#define BRIDGE_IDLE_GAP 20 //ms of quiet (about 20 chars at 9600) that ends what the module sends mid-line
+#define BRIDGE_REPLY_WAIT 2000 //ms for the first byte of the module's reply to a line; some (e.g. "con") are slow
+
+typedef struct {
+	unsigned char base; //Arena offset
+	unsigned char size;
+	unsigned char head; //Next byte out
+	unsigned char used;
+} ring;
+
+void RingInit(ring * r, unsigned char base, unsigned char size) {
+	r->base = base;
+	r->size = size;
+	r->head = 0;
+	r->used = 0;
+}
+
+//Returns 0, dropping the byte, if the ring is full
+unsigned char RingPut(ring * r, unsigned char c) {
+	unsigned char pos;
+	if (r->used>=r->size) {
+		return 0;
+	}
+	pos = r->head+r->used;
+	if (pos>=r->size) {
+		pos -= r->size;
+	}
+	arena[r->base+pos] = c;
+	r->used++;
+	return 1;
+}
+
+unsigned char RingGet(ring * r) {
+	unsigned char c = arena[r->base+r->head];
+	r->head++;
+	if (r->head>=r->size) {
+		r->head = 0;
+	}
+	r->used--;
+	return c;
+}
+
+unsigned char RingStartsWith(ring * r, const char * s, unsigned char len) {
+	unsigned char i, pos;
+	if (r->used!=len) {
+		return 0;
+	}
+	pos = r->head;
+	for (i=0; i<len; i++) {
+		if (arena[r->base+pos]!=s[i]) {
+			return 0;
+		}
+		pos++;
+		if (pos>=r->size) {
+			pos = 0;
+		}
+	}
+	return 1;
+}
+
+//Quick mux hop for the bridge
+void BridgeSelect(unsigned char bt) {
+	while (!(txsta & 0x02)) { //TRMT - let the last byte out first
+		WaitIdle();
+	}
+	if (bt) {
+		portc |= 0x08 ;  //Set C3 (Pin 7) to 1
+		ConfigSerialForBlueTooth();
+		if (should_be_in_bt_command_mode_when_powered_and_bt_selected) {
+			porta &= 0xDF; //Drive Pin 2 straight to 0, so command mode isn't dropped in passing
+			trisa &= 0xDF;
+		} else {
+			ConfigPin2ForBTcontrol();
+		}
+	} else {
+		portc &= 0xF7 ;  //Set C3 (Pin 7) to 0
+		ConfigSerialForWired();	
+		ConfigPin2ForButton();
+	}
+	interval si = GetInterval(BRIDGE_SETTLE_DELAY);
+	while (!IntervalOver(&si)) {
+		WaitIdle();
+	}
+	FlushRxHwBuffer(); //Whatever glitched in during the hop
+}
+
+//The console's counters are left alone by MCLR and WDT resets, but power up as garbage. NOT_POR reads 0
+//only after a power-on reset (until it's set here), so that's when they're cleared.
+void ClearStatsAfterPowerOn(void) {
+	if (pcon & 0x02) { //NOT_POR
+		return;
+	}
+	pcon |= 0x02; //NOT_POR
+	wake_to_first_cmd_ms = 0;
+	dup_suppressed = 0;
+	listen_capped = 0;
+	listen_overflows = 0;
+	slow_deliveries = 0;
+}
+
 void BT_ConsoleLoop(void) {
 
-	unsigned char i,j;
+	unsigned char c, line_done, got_reply;
+	ring pc, bt;
+	interval li;
+
+	//Report the wake-up to first command latency, and the duplicate scans dropped, from before the reset
+	SerialSelectWired();
+	WriteStr("\n\rWake->cmd ms: 0x");
+	WriteHexShort(wake_to_first_cmd_ms);
+	WriteStr("\n\rDups dropped: 0x");
+	WriteHexShort(dup_suppressed);
+	WriteStr("\n\rRx cut, overflowed: 0x");
+	WriteHexShort(listen_capped);
+	WriteStr(" 0x");
+	WriteHexShort(listen_overflows);
+	WriteStr("\n\rSlow deliveries: 0x");
+	WriteHexShort(slow_deliveries);
 
 	//Ensure that bluetooth module is in command mode
 	SerialSelectBlueTooth();
 	EnterBTCommandMode();
+
+	RingInit(&pc, ARENA_RX_OFFSET, BRIDGE_PC_RING_LENGTH);
+	RingInit(&bt, ARENA_RX_OFFSET+BRIDGE_PC_RING_LENGTH, BRIDGE_BT_RING_LENGTH);
+	BridgeSelect(0);
+	WriteStr("\n\r\n\rPC:");
 	
 	while(1) {	
 
 		clear_wdt();
 
-		SerialSelectWired();
-
-		//Terminal->MicroController
-		i=0;
-		WriteStr("\n\r\n\r");
-		//WriteStr("\rPC->MC:");
-		WriteStr("PC:");
-		while (1) {
-			clear_wdt();
-			rx_buff[i] = ReadChar();
-			//Echo
-			//++++
-			if (rx_buff[i]==13) { //13='\r'
-				WriteChar('\n');
-			}
-			WriteChar(rx_buff[i]);
-			//----
-			if (rx_buff[i]=='\r') {
-				WriteStr("\n\r");
-				break;
-			}
-			i++;
-			if (i>=RX_BUFF_LENGTH) {
-				i=RX_BUFF_LENGTH-1;
-				break;
-			}
+		//Terminal->MicroController, with echo
+		c = ReadChar();
+		if (c==13) { //13='\r'
+			WriteChar('\n');
 		}
-		if (str_equal(rx_buff, "out\r", 4)) {
+		WriteChar(c);
+		RingPut(&pc, c);
+		if (c!='\r' && pc.used<pc.size) {
+			continue;
+		}
+
+		if (RingStartsWith(&pc, "out\r", 4)) {
 			return;
 		}
+		if (RingStartsWith(&pc, "cap\r", 4) || RingStartsWith(&pc, "dump\r", 5)) {
+			if (pc.used==4) {
+				TraceArm();
+			} else {
+				TraceDump();
+			}
+			pc.used = 0;
+			pc.head = 0;
+			WriteStr("\n\r\n\rPC:");
+			continue;
+		}
 
-		SerialSelectBlueTooth();
+		BridgeSelect(1);
 
 		//Microcontroller->Bluetooth
-		//WriteStr("\rMC->BT:");
-		if ( str_equal(rx_buff, "+++\r", 4) ) {
-			EraseBuffer(rx_buff, RX_BUFF_LENGTH);
-			FlushRxHwBuffer();
+		line_done = (c=='\r');
+		if (RingStartsWith(&pc, "+++\r", 4)) {
+			pc.used = 0;
 			EnterBTCommandMode();
 		}
-		else if ( str_equal(rx_buff, "ret\r", 4) ) {
-			EraseBuffer(rx_buff, RX_BUFF_LENGTH);
-			FlushRxHwBuffer();
+		else if (RingStartsWith(&pc, "ret\r", 4)) {
+			pc.used = 0;
 			ExitBTCommandMode();
 		}
-		else {
-			for(j=0;j<i;j++){
-				WriteChar(rx_buff[j]);
-			}
-			EraseBuffer(rx_buff, RX_BUFF_LENGTH);
-			FlushRxHwBuffer();
-			WriteChar('\r'); //Sends the command to bluetooth module
+		while (pc.used!=0) {
+			WriteChar(RingGet(&pc));
 		}
 
-		//Bluetooth->MicroController
-		i=ListenForResponse(NULL, 0, 0, 2000);
+		//Bluetooth->MicroController, for as long as the module keeps talking. A reply is only
+		//waited for once the line is complete, and then its bytes may be up to an inter-char delay apart.
+		got_reply = 0;
+		if (line_done) {
+			li = GetInterval(BRIDGE_REPLY_WAIT);
+		} else {
+			li = GetInterval(BRIDGE_IDLE_GAP);
+		}
+		while (!IntervalOver(&li) && bt.used<bt.size) {
+			WaitIdle();
+			if (rcsta & 0x02) { //OERR (Bit 1)
+				rcsta &= 0xEF ; //Clear CREN to 0 (Bit 4)
+				rcsta |= 0x10 ; //Set CREN to 1 (Bit 4)
+			}
+			if (pir1 & 0x20) { //RXIF
+				RingPut(&bt, rcreg);
+				got_reply = 1;
+				if (line_done) {
+					li = GetInterval(MAX_BT_INTER_CHAR_RESPONSE_DELAY);
+				} else {
+					li = GetInterval(BRIDGE_IDLE_GAP);
+				}
+			}
+		}
+		pc.head = 0;
 
-		SerialSelectWired();
+		BridgeSelect(0);
 
 		//Microcontroller->Terminal
-		if (i!=DONE_FAILURE) {
-			//WriteStr("MC->PC:");
-			j=0;
-			while(j<RX_BUFF_LENGTH && rx_buff[j]!=NULL){
-				if (rx_buff[j]==13) { //13='\r'
-					WriteChar('\n');
-				}
-				WriteChar(rx_buff[j]);
-				j++;
-			}	
+		while (bt.used!=0) {
+			c = RingGet(&bt);
+			if (c==13) { //13='\r'
+				WriteChar('\n');
+			}
+			WriteChar(c);
 		}
-		else {
-			WriteStr("<No response>");
+		bt.head = 0;
+		if (line_done) {
+			if (!got_reply) {
+				WriteStr("<No response>");
+			}
+			WriteStr("\n\r\n\rPC:");
 		}
 	}
 }
@@ -1121,111 +3468,8 @@ void BT_ConsoleLoop(void) {
 
 unsigned char ProgramDefaults() {
 
-	unsigned char res, x;
- 	res = x = 0;
-
-	//Set Bluetooth Module Defaults
-	//+++++++
-	SerialSelectBlueTooth();
-
-	//Verify we are in command mode 
-	//for the bluetooth module...
-	EnterBTCommandMode();
- 	x = Send("\r", 1, ">", 1, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-	//Expected length is 0 because we could receive a >NACK as well as a >
- 	res	+= x;
-
-	Send("rst factory\r", 12, NULL, 0, 0, 1, 2000);
-
-	//Verify we are once again in command mode after the reset 
-	ExitBTCommandMode();
-	EnterBTCommandMode();
-	x = Send("\r", 1, ack_s, 3, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-	if (x==0) {
- 		x = Send("\r", 1, ">", 1, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-	}
-	//Expected length is 0 because we could receive a >NACK as well as a >
- 	res	+= x;
-
- 	x = Send("set name BarCodeKey\r", 20, ack_s, 3, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
- 	res	+= x;
-
- 	x = Send("set encrypt off\r", 16, ack_s, 3, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
- 	res	+= x;
-
- 	x = Send("set txpower 10\r", 15, ack_s, 3, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
- 	res	+= x;
-
- 	x = Send("ret\r", 4, ack_s, 3, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-	//Only compare against the first three characters of the ack response, because it could be we're not returning
-	//to an existing connection. We're probably not!
- 	res	+= x;
-	ExitBTCommandMode();
-
-/*
-if (x==1) {
-TurnLEDon();
-}
-SerialSelectWired();
-PrintBufferBytes(rx_buff, 30);
-while(1){clear_wdt();};
-*/
-	//------
-
-
-//res=0;
-
-	SerialSelectWired();
-
-
-	//Set Bar Code Reader Defaults
-	//+++++++
-	ms_delay(BCR_BUTTON_RELEASE_TO_BCR_WAKEUP_DELAY);
-	
-	SetHIto(1); //Wakes barcode reader
-
-	ms_delay(BCR_WAKEUP_TO_INTERROGATE_DELAY);
-
-
-	//Establish connection by sending an "interrogate" command
- 	x = Send(bcr_interrogate_cmd, BCR_INTERROGATE_CMD_LENGTH, 
-			 bcr_interrogate_response_start, BCR_INTERROGATE_RESPONSE_START_LENGTH, BCR_INTERROGATE_RESPONSE_LENGTH, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
- 	res	+= x;
-
-
-	ms_delay(INTERROGATE_TO_DR_READY_DELAY);
-
-
-	//Restore defaults
- 	x = Send(bcr_restore_defaults_cmd, BCR_RESTORE_DEFAULTS_CMD_LENGTH, 
-			 bcr_restore_defaults_response, BCR_RESTORE_DEFAULTS_RESPONSE_LENGTH, BCR_RESTORE_DEFAULTS_RESPONSE_LENGTH, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
- 	res	+= x;
-
-
-	//Customize defaults
-	//************
- 	x = Send(bcr_customize_defaults_cmd, BCR_CUSTOMIZE_DEFAULTS_CMD_LENGTH, 
-			 bcr_customize_defaults_response, BCR_CUSTOMIZE_DEFAULTS_RESPONSE_LENGTH, BCR_CUSTOMIZE_DEFAULTS_RESPONSE_LENGTH, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
- 	res	+= x;
-
-
-	//Power Down
- 	x = Send(bcr_power_down_cmd, BCR_POWER_DOWN_CMD_LENGTH, 
-			 bcr_power_down_response, BCR_POWER_DOWN_RESPONSE_LENGTH, BCR_POWER_DOWN_RESPONSE_LENGTH, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
-	//res += x; Doesn't equal 1; not sure why. Seems to power down fine.
-
-	SetHIto(0); //Prepare for next barcode reader wake-up
-	//------
-
-//BlinkLED(res, 500, 500);
-//ms_delay(2000);
-
 	//Results!
-	if (res==9) { //All commands properly received
+	if (RunSequence(provision_seq) || RunSequence(program_defaults_seq)) { //All commands properly received
 		BlinkLED(3, 1000, 1000);		
 		return 1;
 	} 
@@ -1251,9 +3495,7 @@ unsigned char GetAnyBarCodes(void){
 	ms_delay(BCR_WAKEUP_TO_INTERROGATE_DELAY);
 
 	//Establish connection by sending an "interrogate" command
- 	Send(bcr_interrogate_cmd, BCR_INTERROGATE_CMD_LENGTH, 
-			 bcr_interrogate_response_start, BCR_INTERROGATE_RESPONSE_START_LENGTH, BCR_INTERROGATE_RESPONSE_LENGTH, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
+ 	RunCommand(CMD_BCR_INTERROGATE);
 
 	ms_delay(INTERROGATE_TO_DR_READY_DELAY);
 
@@ -1261,36 +3503,29 @@ unsigned char GetAnyBarCodes(void){
 	if (GetDR()) {
 
 		//Send a signal
-		BlinkLED(2,100,100);
+		BlinkLED(2, BCR_DATA_BLINK_MS, BCR_DATA_BLINK_MS);
 
 		//Upload barcode(s)
- 		result = Send(bcr_upload_cmd, BCR_UPLOAD_CMD_LENGTH, 
-			bcr_upload_response_start, BCR_UPLOAD_RESPONSE_START_LENGTH, 0, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
+ 		result = RunCommand(CMD_BCR_UPLOAD);
 
 		//If we've received a valid barcode...
 		if ( result && (ValidBarCodeJustReceived()==BC_VALID) ) {
-			unsigned char bc_length = rx_buff[FIRST_BARCODE_STRLEN_I]-5;
-			//Clip in case of bad value. Leave room for eol char
-			if ( bc_length>((RX_BUFF_LENGTH-1)-FIRST_BARCODE_START_I) ) {
-				bc_length=(RX_BUFF_LENGTH-1)-FIRST_BARCODE_START_I;
+			unsigned char bc_length = rx_buff[FIRST_BARCODE_STRLEN_I]-5; //No more than MAX_BARCODE_CHARS; the validator saw to it
+			bc_length = PackBarcode(bc_length);
+			//Unless it's a repeat of a recent scan, hold it where it is; from here on, 
+			//replies land in front of it
+			if (!DupCacheSuppress(FIRST_BARCODE_START_I, bc_length)) {
+				ArenaHoldBarcode(FIRST_BARCODE_START_I, bc_length);
+				Checkpoint(STATE_GETTING_BARCODE_FROM_READER); //Before the reader gets cleared
 			}
-			//Copy...
-			copy_buffer_from_to( (rx_buff+FIRST_BARCODE_START_I), barcode_buff, bc_length);
-			//Add an eol char.
-			barcode_buff[bc_length]='\0';
 		}
 
 		//Clear barcode(s) in barcode reader
- 		Send(bcr_clear_barcodes_cmd, BCR_CLEAR_BARCODES_CMD_LENGTH, 
-			 bcr_clear_barcodes_response, BCR_CLEAR_BARCODES_RESPONSE_LENGTH, BCR_CLEAR_BARCODES_RESPONSE_LENGTH, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
+ 		RunCommand(CMD_BCR_CLEAR_BARCODES);
 	}
 
 	//Power Down
- 	Send(bcr_power_down_cmd, BCR_POWER_DOWN_CMD_LENGTH, 
-			 bcr_power_down_response, BCR_POWER_DOWN_RESPONSE_LENGTH, BCR_POWER_DOWN_RESPONSE_LENGTH, 
-			 NUM_BCR_CMD_TRIES, MAX_BCR_INTER_CHAR_RESPONSE_DELAY);
+ 	RunCommand(CMD_BCR_POWER_DOWN);
 	
 	SetHIto(0); //Prepare for next barcode reader wake-up
 	
@@ -1298,58 +3533,146 @@ unsigned char GetAnyBarCodes(void){
 }
 
 
+//Command mode, checked with a bare prompt unless the module has already answered one since it 
+//was powered
+unsigned char BT_VerifyCommandMode(void) {
+	EnterBTCommandMode();
+	if (bt_state & BT_S_ALIVE) {
+		return 1;
+	}
+	//">" or ">NACK" can both mean we are in communication
+	if (RunCommand(CMD_BT_PROMPT)) {
+		bt_state |= BT_S_ALIVE;
+		return 1;
+	}
+	return 0;
+}
+
+//Drops one phone (its address streamed from EEPROM) from the module's trusted list; the rest stay
+void BT_DelTrusted(unsigned char pos) {
+	EraseBuffer(rx_buff, rx_buff_length);
+	FlushRxHwBuffer();
+	WriteStr("del trusted ");
+	WriteEEPROMBytes(pos, BT_ADDRESS_LENGTH);
+	WriteChar('\r');
+	ListenForResponse(NULL, 0, 0, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
+}
+
+//Snapshots "lst trusted" (see BT_LST_SNAPSHOT_I). Returns 0 if the module didn't answer.
+unsigned char BT_SnapshotTrusted(void) {
+	unsigned char n, k, ok;
+
+	ok = 0;
+	for (n=0; n<NUM_BT_CMD_TRIES && !ok; n++) {
+		ok = RunCommand(CMD_BT_LST_TRUSTED);
+	}
+	rx_buff[BT_LST_SNAPSHOT_I] = 0;
+	for (n=0; ok && n<NUM_BT_PEERS; n++) {
+		k = BT_LST_FIRST_I+n*BT_LST_ENTRY_LENGTH;
+		if (BT_AddressIsValid(rx_buff+k)) {
+			DupHash(ARENA_RX_OFFSET+k, BT_ADDRESS_LENGTH);
+			rx_buff[BT_LST_SNAPSHOT_I] |= (1<<n);
+			rx_buff[BT_LST_SNAPSHOT_I+1+2*n] = dup_crc;
+			rx_buff[BT_LST_SNAPSHOT_I+2+2*n] = dup_sum;
+		}
+	}
+	return ok;
+}
+
+//Returns 1 if the listed address at rx_buff[k] wasn't in the snapshot. The list may come back 
+//in a different order, so every entry is compared.
+unsigned char BT_TrustedIsNew(unsigned char k) {
+	unsigned char n;
+
+	DupHash(ARENA_RX_OFFSET+k, BT_ADDRESS_LENGTH);
+	for (n=0; n<NUM_BT_PEERS; n++) {
+		if ((rx_buff[BT_LST_SNAPSHOT_I] & (1<<n)) && rx_buff[BT_LST_SNAPSHOT_I+1+2*n]==dup_crc && 
+			rx_buff[BT_LST_SNAPSHOT_I+2+2*n]==dup_sum) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//Back to data mode. The "ret" exchange is only needed when the link state is in doubt: the expected
+//length is unknown; either we expect nothing or an error because there wasn't a prior connection.
+void BT_ReturnFromCommandMode(void) {
+	if (!(bt_state & BT_S_LINK_KNOWN)) {
+		//NOTE: WriteStr doesn't clear RxBuff
+		WriteStr("ret\r");
+		ListenForResponse(NULL, 0, 0, MAX_BT_INTER_CHAR_RESPONSE_DELAY); 
+	}
+	ExitBTCommandMode();
+}
+
+//Tries the stored peers, most recent success first, and moves the one that answers to the front.
 unsigned char ConnectToRemoteBT() {
 
 	//Assumes we're on the Bluetooth channel and keeps us theres
-	BT_Address2Buff(str_buff+4);
-	if (!BT_AddressIsValid(str_buff+4)) {
+	unsigned char res, order, rank, pos, num_peers;
+	retry_policy r;
+
+	order = PeerOrder();
+	num_peers = 0;
+	for (rank=0; rank<NUM_BT_PEERS; rank++) {
+		if (BT_StoredAddressIsValid(PeerPos(PeerAt(order, rank)))) {
+			num_peers++;
+		}
+	}
+	if (num_peers==0) {
 		return 0;
 	}
 
-	unsigned char i,res;
+	//Already connected, as far as we know
+	if ((bt_state & BT_S_LINK_KNOWN) && (bt_state & BT_S_CONNECTED)) {
+		return 1;
+	}
 
 	//Enter BT Command Mode; Verify we're in it
-	EnterBTCommandMode();
- 	res=Send("\r", 1, ">", 1, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-	//expected response length isn't given because we could receive ">" or ">NACK"
-	//and either can mean we are in communication
+	res=BT_VerifyCommandMode();
 
 	if (res) {
-		//Construct the connect command...
-		str_buff[0]='c';
-		str_buff[1]='o';
-		str_buff[2]='n';
-		str_buff[3]=' ';
-		//4-20 Are the address
-		str_buff[21]='\r';
-		str_buff[22]='\0';
-
 		res=0;
-		for (i=0;i<4;i++) {
-			Send(str_buff, 22, NULL, 0, 10, 1, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-			if (buff_equal(rx_buff, ack_s, 3)) {
-				//If there was no connection error, or the connection error was due to an existing connection
-				//i.e.. "ACK\r>" or "ACK\r>Err 3"
-				if ( (rx_buff[9]==0x00) || (rx_buff[9]==0x33) ) { //0x33='3'
-					res=1;
-					break;
+		bt_state &= ~BT_S_LINK_KNOWN;
+		for (rank=0; rank<NUM_BT_PEERS && !res; rank++) {
+			pos = PeerPos(PeerAt(order, rank));
+			if (!BT_StoredAddressIsValid(pos)) {
+				continue;
+			}
+			RetryInit(&r, NUM_BT_CON_TRIES, RETRY_BT_BACKOFF, RETRY_BT_MAX_BACKOFF);
+			while (RetryNext(&r)) {
+				//Connect command: "con <address>\r", with the address streamed straight from EEPROM
+				EraseBuffer(rx_buff, rx_buff_length);
+				FlushRxHwBuffer();
+				WriteStr("con ");
+				WriteEEPROMBytes(pos, BT_ADDRESS_LENGTH);
+				WriteChar('\r');
+				listen_wake_preamble = ack_s[0]; //Sleep until the reply starts; "CK" is still checked
+				listen_wake_frame_length = LISTEN_WAKE_FIRST_ONLY;
+				ListenForResponse(NULL, 0, 10, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
+				listen_wake_frame_length = 0;
+				if (buff_equal(rx_buff, ack_s, 3)) {
+					//If there was no connection error, or the connection error was due to an existing connection
+					//i.e.. "ACK\r>" or "ACK\r>Err 3"
+					if ( (rx_buff[9]==0x00) || (rx_buff[9]==0x33) ) { //0x33='3'
+						res=1;
+						break;
+					}
 				}
 			}
 		}
+		if (res) {
+			bt_state |= BT_S_LINK_KNOWN|BT_S_CONNECTED;
+			if (rank!=1) { //(rank is one past the peer that answered)
+				PromotePeer(PeerAt(order, rank-1));
+			}
+		}
 	}
 
-	//Returning
-	//The expected length is unknown; either we expect nothing
-	//or an error because there wasn't a prior connection.
-	//NOTE: WriteStr doesn't clear RxBuff
-	WriteStr("ret\r");
-	ListenForResponse(NULL, 0, 0, MAX_BT_INTER_CHAR_RESPONSE_DELAY); 
-	//***RET MAY BE UN-NECESSARY...
-
-	ExitBTCommandMode();
+	BT_ReturnFromCommandMode();
 
 	if (res) {
-		BlinkLED(1,50,50);
+		BlinkLED(1, BT_CON_BLINK_MS, BT_CON_BLINK_MS);
 		return 1;
 	}
 	return 0;
@@ -1363,26 +3686,19 @@ unsigned char DisconnectFromRemoteBT() {
 	unsigned char res;
 
 	//Enter BT Command Mode; Verify we're in it
-	EnterBTCommandMode();
- 	res=Send("\r", 1, ">", 1, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-	//expected response length isn't given because we could receive ">" or ">NACK"
+	res=BT_VerifyCommandMode();
 
 	if (res) {
 		//Disconnect command
-		res=Send("dis\r", 4, ack_s, 3, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY); 
+		bt_state &= ~BT_S_LINK_KNOWN;
+		res=RunCommand(CMD_BT_DIS); 
 		if (res) {
+			bt_state |= BT_S_LINK_KNOWN;
+			bt_state &= ~BT_S_CONNECTED;
 		}
 	}
 
-	//Returning
-	//The expected length is unknown; either we expect nothing
-	//or an error because there wasn't a prior connection.
-	//NOTE: WriteStr doesn't clear RxBuff
-	WriteStr("ret\r");
-	ListenForResponse(NULL, 0, 0, MAX_BT_INTER_CHAR_RESPONSE_DELAY); 
-	//***RET MAY BE UN-NECESSARY..
-
-	ExitBTCommandMode();
+	BT_ReturnFromCommandMode();
 
 	if (res) {
 		return 1;
@@ -1391,6 +3707,390 @@ unsigned char DisconnectFromRemoteBT() {
 }
 
 
+//Timing Budget
+//+++++++++++++++++++++++++++++++++++++++++++++
+//A worst case (WC_) and nominal (NOM_) model of how long each path through main()'s delivery states 
+//takes, in ms, and of the charge it draws, in mA*s. It's built from the same definitions the firmware 
+//uses (tries, timeouts, delays, backoff, queue and window sizes), so it follows them when they change; 
+//the self benchmark prints it, and the build fails if a delivery state could outlast the watchdog. (Every
+//wait clears the WDT, so a long path doesn't reset the processor by itself; but a watchdog reset is what
+//a hang in one looks like, and checkpoint resume assumes one state's pass fits a period. A scan is two
+//states, each checkpointed on entry, so WC_SCAN is reported but only its states are checked. Learning, 
+//provisioning, console and benchmark modes are interactive, and aren't modeled.)
+//Worst case: every reply starts just inside its timeout and lasts its whole reply span (however the bytes 
+//trickle in, ListenForResponse() cuts it off there), a command's is then drained, every retry is taken 
+//with its full backoff and jitter, every peer is tried, and the queue is full of the shortest records, 
+//each acknowledged only on its last round. A session stops retry loops only between tries, so it can overrun by the longest
+//try, and what follows the loops (ret, dis) runs regardless.
+//Nominal: everything answers on the first try, with replies of their usual lengths, and one barcode.
+//Terms are long (1L), since they pass a 16-bit int. Charges use estimated currents: the PIC's from its
+//data sheet, the EB101's guesses, to be replaced with bench measurements.
+//The shortest watchdog period: InitWDT()'s prescalers with the LFINTOSC at its data sheet maximum (31kHz 
+//nominal gives ~33.8 sec), and the part of it a state may use, leaving the model's estimates some room
+#define WDT_WDTPS_DIV 8192L //WDTCON WDTPS 1000
+#define WDT_PS_DIV 128L //OPTION_REG PS 111, with PSA assigning the prescaler to the WDT (their reset values)
+#define LFINTOSC_MAX_HZ 45000L
+#define WDT_MIN_PERIOD_MS (WDT_WDTPS_DIV*WDT_PS_DIV*1000L/LFINTOSC_MAX_HZ) //~23.3 sec
+#define WDT_BUDGET_MS (WDT_MIN_PERIOD_MS*4/5)
+#define WC_BYTE_US 1146L //An 11-bit frame at 9600; bluetooth frames are shorter
+#define WC_BYTES_MS(n) (((n)*WC_BYTE_US+999)/1000)
+#define WC_DELAY(x) (1L*(x)+((x)>=CLOCK_IDLE_MIN_DELAY ? CLK_IDLE_MS_PER_TICK : 1)) //Idle clock granularity
+#define WC_LISTEN(timeout) (1L*(timeout)+LISTEN_REPLY_SPAN)
+#define NOM_REPLY_MS 20L //Turnaround, before the first byte of a reply
+#define WC_BLINK(n, t) ((n)*2*WC_DELAY(t))
+
+//Backoff before retry k (the first retry is k=0), with its jitter, and the sum before the retries of n tries
+#define WC_BACKOFF_K(k) (((RETRY_BT_BACKOFF<<(k))<RETRY_BT_MAX_BACKOFF ? (RETRY_BT_BACKOFF<<(k)) : RETRY_BT_MAX_BACKOFF)*3L/2)
+#define WC_BACKOFF_IF(k, n) ((k)<(n)-1 ? WC_DELAY(WC_BACKOFF_K(k)) : 0)
+#define WC_BACKOFF(n) (WC_BACKOFF_IF(0,n)+WC_BACKOFF_IF(1,n)+WC_BACKOFF_IF(2,n)+WC_BACKOFF_IF(3,n)+ \
+	WC_BACKOFF_IF(4,n)+WC_BACKOFF_IF(5,n)+WC_BACKOFF_IF(6,n)+WC_BACKOFF_IF(7,n)) //Up to 9 tries
+#define WC_MAX_BACKOFF (RETRY_BT_MAX_BACKOFF*3L/2)
+
+//Commands, mux and power
+#define WC_DRAIN(gap) (1L*(gap)+LISTEN_REPLY_SPAN) //DrainRx(), after a corrupt or cut off reply
+#define WC_BT_CMD (NUM_BT_CMD_TRIES*(WC_LISTEN(BT_CMD_TIMEOUT*10)+WC_DRAIN(BT_CMD_TIMEOUT*10)))
+#define WC_BCR_CMD (NUM_BCR_CMD_TRIES*(WC_LISTEN(BCR_CMD_TIMEOUT*10)+WC_DRAIN(BCR_CMD_TIMEOUT*10)))
+#define NOM_BT_CMD (NOM_REPLY_MS+WC_BYTES_MS(BT_ACK_LENGTH)+BT_CMD_TIMEOUT*10) //Unknown length: ends in a timeout
+#define NOM_BCR_CMD(len) (NOM_REPLY_MS+WC_BYTES_MS(len)) //Known length
+#define WC_POWER_ON WC_DELAY(SECONDARY_POWER_DELAY)
+#define WC_SELECT (2*WC_DELAY(SERIAL_SELECT_DELAY))
+#define WC_BT_MODE WC_DELAY(BT_MODE_SWITCH_DELAY)
+
+//ConnectToRemoteBT(): the prompt, then each peer's tries, then "ret"
+#define WC_CON_TRY (WC_BYTES_MS(4+BT_ADDRESS_LENGTH+1)+WC_LISTEN(MAX_BT_INTER_CHAR_RESPONSE_DELAY))
+#define WC_CON_TAIL (WC_LISTEN(MAX_BT_INTER_CHAR_RESPONSE_DELAY)+WC_BT_MODE+WC_BLINK(1, BT_CON_BLINK_MS))
+#define WC_CON (WC_BT_MODE+WC_BT_CMD+NUM_BT_PEERS*(NUM_BT_CON_TRIES*WC_CON_TRY+WC_BACKOFF(NUM_BT_CON_TRIES))+WC_CON_TAIL)
+#define NOM_CON (WC_BT_MODE+NOM_BT_CMD+WC_BYTES_MS(4+BT_ADDRESS_LENGTH+1)+NOM_BT_CMD+WC_CON_TAIL)
+#define WC_DIS (WC_BT_MODE+WC_BT_CMD+WC_LISTEN(MAX_BT_INTER_CHAR_RESPONSE_DELAY)+WC_BT_MODE)
+#define NOM_DIS (WC_BT_MODE+NOM_BT_CMD+WC_BT_MODE) //The link is known after "dis"
+
+//DeliverPending(): rounds of a window of frames, then a listen for the acknowledgments
+#define WC_FRAMES (BC_QUEUE_LENGTH/(BC_RECORD_HEADER_LENGTH+BC_PACKED_HEADER_LENGTH+1)+1) //Queue, plus the held one
+#define WC_FRAME_BYTES (BT_FRAME_OVERHEAD+MAX_BARCODE_LENGTH)
+#define WC_ROUND (WC_BYTES_MS(BT_SEND_WINDOW*WC_FRAME_BYTES)+MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY+BT_ACK_REPLY_SPAN)
+#define WC_DELIVER (WC_FRAMES*(NUM_BT_SEND_TRIES*WC_ROUND+WC_BACKOFF(NUM_BT_SEND_TRIES)))
+#define NOM_DELIVER (WC_BYTES_MS(WC_FRAME_BYTES)+NOM_REPLY_MS+WC_BYTES_MS(BT_ACK_FRAME_LENGTH))
+
+//A session's loops, capped by its budget
+#define WC_SESSION_OVERRUN ((WC_ROUND>WC_CON_TRY ? WC_ROUND : WC_CON_TRY)+WC_MAX_BACKOFF+WC_CON_TAIL)
+#define WC_SESSION(x) ((x)<BT_SESSION_BUDGET+WC_SESSION_OVERRUN ? (x) : BT_SESSION_BUDGET+WC_SESSION_OVERRUN)
+
+//The delivery states, and the paths through them
+#define WC_GETTING (WC_POWER_ON+WC_SELECT+WC_DELAY(BCR_BUTTON_RELEASE_TO_BCR_WAKEUP_DELAY)+ \
+	WC_DELAY(BCR_WAKEUP_TO_INTERROGATE_DELAY)+WC_BCR_CMD+WC_DELAY(INTERROGATE_TO_DR_READY_DELAY)+ \
+	WC_BLINK(2, BCR_DATA_BLINK_MS)+2*WC_BCR_CMD+WC_BYTES_MS(BCR_POWER_DOWN_CMD_LENGTH))
+#define NOM_GETTING (WC_POWER_ON+WC_SELECT+WC_DELAY(BCR_BUTTON_RELEASE_TO_BCR_WAKEUP_DELAY)+ \
+	WC_DELAY(BCR_WAKEUP_TO_INTERROGATE_DELAY)+NOM_BCR_CMD(BCR_INTERROGATE_RESPONSE_LENGTH)+ \
+	WC_DELAY(INTERROGATE_TO_DR_READY_DELAY)+WC_BLINK(2, BCR_DATA_BLINK_MS)+ \
+	NOM_BCR_CMD(BCR_UPLOAD_RESPONSE_MINIMUM_LENGTH+MAX_BARCODE_LENGTH)+BCR_CMD_TIMEOUT*10+ \
+	NOM_BCR_CMD(BCR_CLEAR_BARCODES_RESPONSE_LENGTH)+WC_BYTES_MS(BCR_POWER_DOWN_CMD_LENGTH))
+#define WC_SENDING (WC_POWER_ON+2*WC_SELECT+WC_SESSION(WC_CON+WC_DELIVER)+WC_DIS)
+#define NOM_SENDING (WC_POWER_ON+2*WC_SELECT+NOM_CON+NOM_DELIVER+NOM_DIS)
+#define WC_RUAWAKE_SEND (NUM_BT_SEND_TRIES*(WC_BYTES_MS(1)+WC_LISTEN(MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY))+WC_BACKOFF(NUM_BT_SEND_TRIES))
+#define WC_RUAWAKE (WC_POWER_ON+2*WC_SELECT+WC_SESSION(WC_CON+WC_RUAWAKE_SEND)+WC_DIS)
+#define NOM_RUAWAKE (WC_POWER_ON+2*WC_SELECT+NOM_CON+NOM_REPLY_MS+WC_BYTES_MS(2)+MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY+NOM_DIS)
+#define WC_SCAN (WC_GETTING+WC_SENDING) //Scan to delivery, or to giving up
+#define NOM_SCAN (NOM_GETTING+NOM_SENDING)
+
+//Charge, in mA*s. The reader has its own battery.
+#define I_MCU_MA 2L //8MHz internal oscillator
+#define I_BT_IDLE_MA 25L //EB101 powered, not connected (estimate)
+#define I_BT_LINK_MA 40L //EB101 connecting or connected (estimate)
+#define Q_BCR_PHASE(ms) ((ms)*(I_MCU_MA+I_BT_IDLE_MA)/1000)
+#define Q_BT_PHASE(ms) ((ms)*(I_MCU_MA+I_BT_LINK_MA)/1000)
+#define WC_SCAN_Q (Q_BCR_PHASE(WC_GETTING)+Q_BT_PHASE(WC_SENDING))
+#define NOM_SCAN_Q (Q_BCR_PHASE(NOM_GETTING)+Q_BT_PHASE(NOM_SENDING))
+#define WC_RUAWAKE_Q Q_BT_PHASE(WC_RUAWAKE)
+
+//Deliveries that take longer than this are counted (slow_deliveries): the model has missed something
+#define DELIVERY_LATENCY_BUDGET WC_SENDING
+
+#if WC_GETTING > WDT_BUDGET_MS
+#error "Worst case barcode upload (WC_GETTING) can outlast the watchdog"
+#endif
+#if WC_SENDING > WDT_BUDGET_MS
+#error "Worst case delivery of the queue (WC_SENDING) can outlast the watchdog"
+#endif
+#if WC_RUAWAKE > WDT_BUDGET_MS
+#error "Worst case are-you-awake (WC_RUAWAKE) can outlast the watchdog"
+#endif
+//--------------------------------------------
+
+
+//Self Benchmark
+//+++++++++++++++++++++++++++++++++++++++++++++
+//Measures this unit, for comparing units and builds on the bench. Results are in ms (hex) unless noted:
+//	Tx ms, expected - BENCH_TX_BYTES 'U's sent to the PC, timed by timer0; then how long their 11-bit frames
+//	                  should take at 9600. (Both run off the one oscillator, so this checks the ISR's tick
+//	                  scaling and the baud rate generator's rounding, rather than the oscillator.)
+//	EE 1k reads     - 1024 EEPROM reads
+//	EE writes       - BENCH_EE_WRITES EEPROM writes (of a spare byte, with its own value)
+//	Wired echoed, ms- bytes echoed, each waited for before the next is sent, and how long they took; 
+//	                  needs TX looped back to RX at the PC header
+//	BCR wake->reply - HI raised to the reader's first interrogate reply
+//	BCR wake->DR    - HI raised to DR (after an interrogate); DR only comes if the reader holds barcodes
+//	BT con          - ConnectToRemoteBT(), start to finish, as the sender sees it
+//	BT echoed, ms   - as for wired, over the connection; needs the phone to echo
+//	Poll, Btn cyc   - instruction cycles (timer1, at Fosc/4) for BENCH_HOT_CALLS calls of IntervalOver() and 
+//	                  of ButtonEvent(), with interrupts off: the hot polling loops, less their loop overhead
+//	Span cyc off/on - cycles for a fixed busy loop with interrupts off, then on. Timer0 overflows every 
+//	                  256 cycles, so the ISR's cycles (entry and exit included) are about (on-off)*256/on
+//0xFFFF means it didn't happen in time. The reader is measured first, through the BCR jumpers. LED1 then 
+//stays lit until Button1 is pressed (move the RX/TX jumpers to PC first) or BENCH_JUMPER_WAIT runs out; 
+//the rest is measured, and everything is reported over the wired channel. Results are kept in the queue's
+//part of the arena, which is empty in this mode (it's only reached from a cold start).
+#define BENCH_TX_BYTES 240
+#define BENCH_TX_EXPECTED_MS ((BENCH_TX_BYTES*110)/96) //11 bits a frame, 9600 bits a sec
+#define BENCH_EE_READS 1024
+#define BENCH_EE_WRITES 8
+#define BENCH_ECHO_BYTES 32
+#define BENCH_ECHO_TIMEOUT 200
+#define BENCH_BCR_WAIT 3000
+#define BENCH_JUMPER_WAIT 30000
+#define BENCH_HOT_CALLS 16
+#define BENCH_SPAN_LOOPS 2000 //Keeps the span well under timer1's 65536 cycles
+#define BENCH_NONE 0xFFFF
+
+typedef enum {
+	BENCH_TX_MS=0,
+	BENCH_EE_READ_MS,
+	BENCH_EE_WRITE_MS,
+	BENCH_WIRED_ECHOED,
+	BENCH_WIRED_ECHO_MS,
+	BENCH_BCR_WAKE_MS,
+	BENCH_BCR_DR_MS,
+	BENCH_BT_CON_MS,
+	BENCH_BT_ECHOED,
+	BENCH_BT_ECHO_MS,
+	BENCH_POLL_CYC,
+	BENCH_BUTTON_CYC,
+	BENCH_SPAN_CYC_OFF,
+	BENCH_SPAN_CYC_ON,
+} BENCH_T;
+
+void BenchPut(unsigned char i, unsigned short v) {
+	bc_queue[2*i] = v>>8;
+	bc_queue[2*i+1] = v&0xFF;
+}
+unsigned short BenchGet(unsigned char i) {
+	return (bc_queue[2*i]<<8) | bc_queue[2*i+1];
+}
+
+//Echo test on the selected channel; puts the count at result i and the ms at i+1. Stops at the first
+//byte that doesn't come back, and doesn't count the wait for it.
+void BenchEcho(unsigned char i) {
+	unsigned char n, got;
+	unsigned short t0, t1;
+	interval ei;
+
+	FlushRxHwBuffer();
+	t0 = timer0_isr_count;
+	t1 = t0;
+	for (n=0; n<BENCH_ECHO_BYTES; n++) {
+		WriteChar('U');
+		got = 0;
+		ei = GetInterval(BENCH_ECHO_TIMEOUT);
+		while (!got && !IntervalOver(&ei)) {
+			WaitIdle();
+			if (rcsta & 0x02) { //OERR (Bit 1)
+				rcsta &= 0xEF ; //Clear CREN to 0 (Bit 4)
+				rcsta |= 0x10 ; //Set CREN to 1 (Bit 4)
+			}
+			if (pir1 & 0x20) { //RXIF
+				got = (rcreg=='U');
+			}
+		}
+		if (!got) {
+			break;
+		}
+		t1 = timer0_isr_count;
+	}
+	BenchPut(i, n);
+	BenchPut(i+1, t1-t0);
+}
+
+//Instruction cycle count, on timer1 (1:1 from Fosc/4; otherwise unused)
+void CycStart(void) {
+	t1con = 0x00; //TMR1ON (Bit 0) off
+	tmr1h = 0;
+	tmr1l = 0;
+	t1con = 0x01; //TMR1ON on; internal clock, no prescale
+}
+unsigned short CycStop(void) {
+	t1con = 0x00;
+	return (tmr1h<<8) | tmr1l;
+}
+
+//Cycles for the busy loop, with interrupts as they are
+unsigned short BenchSpan(void) {
+	unsigned short k;
+	CycStart();
+	for (k=0; k<BENCH_SPAN_LOOPS; k++) {
+		clear_wdt();
+	}
+	return CycStop();
+}
+
+void BenchRow(const unsigned char * label, unsigned char i) {
+	WriteStr("\n\r");
+	WriteStr(label);
+	WriteStr(" 0x");
+	WriteHexShort(BenchGet(i));
+}
+
+void SelfBenchmark(void) {
+
+	unsigned char n, b, ev;
+	unsigned short t0, k;
+	interval bi;
+
+	//Barcode reader: wake to first reply, then to data ready
+	SerialSelectWired();
+	BenchPut(BENCH_BCR_WAKE_MS, BENCH_NONE);
+	BenchPut(BENCH_BCR_DR_MS, BENCH_NONE);
+	SetHIto(1); //Wakes barcode reader
+	t0 = timer0_isr_count;
+	bi = GetInterval(BENCH_BCR_WAIT);
+	while (!IntervalOver(&bi)) {
+		if (RunCommand(CMD_BCR_PING)) {
+			BenchPut(BENCH_BCR_WAKE_MS, timer0_isr_count-t0);
+			RunCommand(CMD_BCR_INTERROGATE);
+			while (!IntervalOver(&bi) && !GetDR()) {
+				WaitIdle();
+			}
+			if (GetDR()) {
+				BenchPut(BENCH_BCR_DR_MS, timer0_isr_count-t0);
+			}
+			break;
+		}
+	}
+	RunCommand(CMD_BCR_POWER_DOWN);
+	SetHIto(0);
+
+	//Bluetooth: a real "con" (not the cached link state), then an echo over the connection
+	SerialSelectBlueTooth();
+	bt_state &= ~BT_S_LINK_KNOWN;
+	BT_VerifyCommandMode();
+	BenchPut(BENCH_BT_CON_MS, BENCH_NONE);
+	BenchPut(BENCH_BT_ECHOED, 0);
+	BenchPut(BENCH_BT_ECHO_MS, 0);
+	t0 = timer0_isr_count;
+	if (ConnectToRemoteBT()) {
+		BenchPut(BENCH_BT_CON_MS, timer0_isr_count-t0);
+		BenchEcho(BENCH_BT_ECHOED);
+		DisconnectFromRemoteBT();
+	}
+	SerialSelectWired();
+
+	//Wait for the jumpers to be moved to the PC
+	TurnLEDon();
+	StartButtonSampling(&btn1);
+	bi = GetInterval(BENCH_JUMPER_WAIT);
+	while (!IntervalOver(&bi)) {
+		WaitIdle();
+		ev = ButtonEvent(&btn1);
+		if (ev==BTN_EV_SHORT_PRESS || ev==BTN_EV_LONG_PRESS || ev==BTN_EV_DOUBLE_PRESS) {
+			break;
+		}
+	}
+	StopButtonSampling(&btn1);
+	TurnLEDoff();
+
+	//Timer0 against the bit clock
+	WriteStr("\n\r");
+	while (!(txsta & 0x02)) { //TRMT - start from an idle line
+		WaitIdle();
+	}
+	t0 = timer0_isr_count;
+	for (n=0; n<BENCH_TX_BYTES; n++) {
+		WriteChar('U');
+	}
+	while (!(txsta & 0x02)) { //TRMT - until the last frame is out
+		WaitIdle();
+	}
+	BenchPut(BENCH_TX_MS, timer0_isr_count-t0);
+
+	//EEPROM
+	t0 = timer0_isr_count;
+	for (k=0; k<BENCH_EE_READS; k++) {
+		read_EEPROM_byte(k);
+	}
+	BenchPut(BENCH_EE_READ_MS, timer0_isr_count-t0);
+	b = read_EEPROM_byte(EEPROM_BENCH_SCRATCH_POS);
+	t0 = timer0_isr_count;
+	enable_EEPROM_writes();
+	for (n=0; n<BENCH_EE_WRITES; n++) {
+		write_EEPROM_byte(b, EEPROM_BENCH_SCRATCH_POS);
+	}
+	disable_EEPROM_writes();
+	BenchPut(BENCH_EE_WRITE_MS, timer0_isr_count-t0);
+
+	BenchEcho(BENCH_WIRED_ECHOED);
+
+	//Cycle counts for the hot polling paths, and the ISR's share of a busy loop
+	bi = GetInterval(BENCH_JUMPER_WAIT);
+	intcon &= 0x7F; //Set GIE to 0 to disable interrupts globally
+	CycStart();
+	for (n=0; n<BENCH_HOT_CALLS; n++) {
+		IntervalOver(&bi);
+	}
+	BenchPut(BENCH_POLL_CYC, CycStop());
+	CycStart();
+	for (n=0; n<BENCH_HOT_CALLS; n++) {
+		ButtonEvent(&btn1);
+	}
+	BenchPut(BENCH_BUTTON_CYC, CycStop());
+	BenchPut(BENCH_SPAN_CYC_OFF, BenchSpan());
+	intcon |= 0x80; //Set GIE to 1 to enable interrupts globally
+	BenchPut(BENCH_SPAN_CYC_ON, BenchSpan());
+
+	//Report
+	WriteStr("\n\r\n\r-Bench (hex, ms)-");
+	BenchRow("Tx ms, expected:", BENCH_TX_MS);
+	WriteStr(" 0x");
+	WriteHexShort(BENCH_TX_EXPECTED_MS);
+	BenchRow("EE 1k reads:", BENCH_EE_READ_MS);
+	BenchRow("EE writes:", BENCH_EE_WRITE_MS);
+	BenchRow("Wired echoed, ms:", BENCH_WIRED_ECHOED);
+	WriteStr(" 0x");
+	WriteHexShort(BenchGet(BENCH_WIRED_ECHO_MS));
+	BenchRow("BCR wake->reply:", BENCH_BCR_WAKE_MS);
+	BenchRow("BCR wake->DR:", BENCH_BCR_DR_MS);
+	BenchRow("BT con:", BENCH_BT_CON_MS);
+	BenchRow("BT echoed, ms:", BENCH_BT_ECHOED);
+	WriteStr(" 0x");
+	WriteHexShort(BenchGet(BENCH_BT_ECHO_MS));
+	BenchRow("Poll cyc:", BENCH_POLL_CYC);
+	BenchRow("Btn cyc:", BENCH_BUTTON_CYC);
+	BenchRow("Span cyc off/on:", BENCH_SPAN_CYC_OFF);
+	WriteStr(" 0x");
+	WriteHexShort(BenchGet(BENCH_SPAN_CYC_ON));
+
+	//The timing budget, as built; durations in units of 10 ms
+	WriteStr("\n\r-Model (wc, nom)-");
+	WriteStr("\n\rScan 10ms: 0x");
+	WriteHexShort(WC_SCAN/10);
+	WriteStr(" 0x");
+	WriteHexShort(NOM_SCAN/10);
+	WriteStr("\n\rSend 10ms: 0x");
+	WriteHexShort(WC_SENDING/10);
+	WriteStr(" 0x");
+	WriteHexShort(NOM_SENDING/10);
+	WriteStr("\n\rRUAwake 10ms: 0x");
+	WriteHexShort(WC_RUAWAKE/10);
+	WriteStr(" 0x");
+	WriteHexShort(NOM_RUAWAKE/10);
+	WriteStr("\n\rScan mAs: 0x");
+	WriteHexShort(WC_SCAN_Q);
+	WriteStr(" 0x");
+	WriteHexShort(NOM_SCAN_Q);
+	WriteStr("\n\rRUAwake mAs: 0x");
+	WriteHexShort(WC_RUAWAKE_Q);
+	WriteStr("\n\r");
+}
+//--------------------------------------------
+
+
 
 // main function
 void main(void) {
@@ -1400,39 +4100,72 @@ void main(void) {
 	//the state should be responsible for returning power to its original value...
 		
 	unsigned char prev_state, current_state;
+	unsigned char reset_by_wdt = ((status & 0x10)==0); //NOT_TO; read before anything clears the WDT
 	current_state = STATE_INITIAL;
 
 	while (1) {
 
+		if (current_state!=STATE_INITIAL) {
+			Checkpoint(current_state);
+		}
+
 		if (current_state==STATE_INITIAL) {
 			clear_wdt();
 
 			InitializeEverything();
+			ClearStatsAfterPowerOn();
+			InitSecondaryPower(); //(Left alone on wake-ups, so it can be warmed up during a press)
+			DupCacheInit();
 			TurnOnWDT();
+			prev_state = STATE_INITIAL;
+
+			//After a watchdog reset, resume the interrupted delivery directly
+			if (reset_by_wdt) {
+				reset_by_wdt = 0;
+				current_state = RestoreCheckpoint();
+				if (current_state!=STATE_INITIAL) {
+					//The reader may not have been cleared of the held barcode, and the duplicate
+					//cache started empty; remember it, so its next upload isn't queued again
+					if (barcode_view.length!=0) {
+						DupCacheSuppress(barcode_view.offset, barcode_view.length);
+					}
+					continue;
+				}
+			}
+			ArenaReleaseBarcode();
 
 			//Default next state is sleep state
-			prev_state = STATE_INITIAL;
 			current_state = STATE_ASLEEP_SECONDARY_POWER_OFF;
 
 			//If there is button input, however, we may be entering a
 			//special mode...
+			//Each BTN_HOLD_STEP_MS of holding selects the next mode.
 			TurnSecondaryPowerOn(); //Needed for button to be readable
-			if (ButtonHeldDown(4000)) {
- 				BlinkLED(1, 1000, 1000);
-				current_state = STATE_GET_BLUETOOTH_TO_ADDRESS;
-				if (ButtonIsDown()) {
-					if (ButtonHeldDown(4000)) {
+			StartButtonSampling(&btn1);
+			ms_delay(2*BTN_DEBOUNCE_MS); //Long enough for a held button to register
+			while (!ButtonIdle(&btn1)) {
+				clear_wdt();
+				if (ButtonEvent(&btn1)==BTN_EV_HOLD) {
+					if (btn1.holds==1) {
+		 				BlinkLED(1, 1000, 1000);
+						current_state = STATE_GET_BLUETOOTH_TO_ADDRESS;
+					}
+					else if (btn1.holds==2) {
 	 					BlinkLED(2, 500, 500);
 						current_state = STATE_PROGRAMMING_DEFAULTS;
-						if (ButtonIsDown()) {
-							if (ButtonHeldDown(4000)) {
-	 							BlinkLED(3, 333, 333);
-								current_state = STATE_BT_CONSOLE;
-							}
-						}
 					}
-				} 
+					else if (btn1.holds==3) {
+						BlinkLED(3, 333, 333);
+						current_state = STATE_BT_CONSOLE;
+					}
+					else if (btn1.holds==4) {
+						BlinkLED(4, 250, 250);
+						current_state = STATE_BENCHMARK;
+						break;
+					}
+				}
 			}
+			StopButtonSampling(&btn1);
 			TurnSecondaryPowerOff(); //Was needed for buttons
 		}
 
@@ -1461,6 +4194,18 @@ void main(void) {
 		}
 
 
+		else if (current_state==STATE_BENCHMARK) {
+			clear_wdt();
+
+			TurnSecondaryPowerOn();
+
+			SelfBenchmark();
+
+			prev_state = current_state;
+			current_state = STATE_ASLEEP_SECONDARY_POWER_OFF;
+		}
+
+
 		else if (current_state==STATE_GET_BLUETOOTH_TO_ADDRESS) {
 			clear_wdt();
 			unsigned char i;
@@ -1471,50 +4216,63 @@ void main(void) {
 			SerialSelectBlueTooth(); 
 
 			//Enter BT Command Mode; Verify we're in it
-			EnterBTCommandMode();
- 			i=Send("\r", 1, ">", 1, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-			//expected response length isn't given because we could receive ">" or ">NACK"
-
-			i=Send("del trusted all\r", 16, ack_s, 3, 0, NUM_BT_CMD_TRIES, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
+ 			i=BT_VerifyCommandMode();
+
+			//If the new phone will take a stored peer's slot, only that peer stops being trusted;
+			//the others stay, for failover. The new phone is then the one that shows up in the 
+			//list during the pairing window: whatever was listed before it opened isn't learned.
+			unsigned char slot = PeerSlotForNew();
+			if (i && BT_StoredAddressIsValid(PeerPos(slot))) {
+				BT_DelTrusted(PeerPos(slot));
+			}
+			rx_buff_length = BT_LST_REPLY_LENGTH; //The queue is empty in this mode (it's only reached from a cold start)
+			if (i && !BT_SnapshotTrusted()) {
+				i = 0;
+			}
 
 			if (i) {
-				//Wait for trusted device
+				//Wait for trusted device, polling less often as time goes on (the gaps idle
+				//the clock; people take a while to pair)
 				TurnLEDon();
-				interval pi = GetInterval(40000); //programming interval
+				unsigned char learned = 0;
+				retry_policy r;
+				SessionStart(BT_LEARN_WINDOW);
+				RetryInit(&r, 0xFF, BT_TRUSTED_POLL_GAP, BT_TRUSTED_MAX_POLL_GAP);
 
-
-				while (1) {
+				while (!learned && RetryNext(&r)) {
 					
 					clear_wdt(); 
-	
-					//If timer needs to wrap...
-					if (pi.will_wrap) {
-						if (timer0_isr_count<pi.end_tick) { //wrap has happened
-							pi.will_wrap = 0; //no longer anticipating wrap
-						}
-					}
-					//If timer has timed out...
-					else if (timer0_isr_count>=pi.end_tick) {
-						BlinkLED(7, 500, 500);
-						break;
-					}
 
-					i=Send("lst trusted\r", 12, ack_s, 3, 0, 1, MAX_BT_INTER_CHAR_RESPONSE_DELAY);
-
-					if ((i==1) && (rx_buff[4]!=62)) { //62='>'
-						if (BT_AddressIsValid(rx_buff+4)) {
-							enable_EEPROM_writes();
-							for (i=0; i<BT_ADDRESS_LENGTH; i++) {
-								write_EEPROM_byte(rx_buff[i+4], i);
+					i=RunCommand(CMD_BT_LST_TRUSTED);
+
+					unsigned char k;
+					for (k=BT_LST_FIRST_I; i==1 && !learned && k<BT_LST_REPLY_LENGTH; k+=BT_LST_ENTRY_LENGTH) {
+						if (BT_AddressIsValid(rx_buff+k) && BT_TrustedIsNew(k)) {
+							//Keep the other peers; the new one goes first (a stored one pairing 
+							//again just moves up)
+							unsigned char s = PeerSlotOf(rx_buff+k);
+							if (s==NUM_BT_PEERS) {
+								unsigned char pos = PeerPos(slot);
+								enable_EEPROM_writes();
+								for (i=0; i<BT_ADDRESS_LENGTH; i++) {
+									write_EEPROM_byte(rx_buff[k+i], pos+i);
+								}
+								write_EEPROM_byte('\0', pos+i);
+								disable_EEPROM_writes();
+								s = slot;
 							}
-							write_EEPROM_byte('\0', i);
-							disable_EEPROM_writes();
+							PromotePeer(s);
 							BlinkLED(4, 1000, 1000);
-							break;
+							learned = 1;
 						}
 					}	
 				}
+				SessionEnd();
+				if (!learned) {
+					BlinkLED(7, 500, 500);
+				}
 			}
+			ArenaReleaseBarcode(); //Back to the usual rx window
 
 			SerialSelectWired();
 
@@ -1526,56 +4284,11 @@ void main(void) {
 		else if (current_state==STATE_ASLEEP_SECONDARY_POWER_OFF) {
 			clear_wdt();
 
-			TurnSecondaryPowerOff();
-
-			//Configure  Pins for Low Power
-			//++++++++++++++++
-			//Pin 1 - Vdd. Do nothing
-				
-			//Pin 2 - Btn/BtBreak. Both connect to weak pullups, so we
-			//set this to a high output
-			porta |= 0x20; //Set Pin 2 to 1
-			trisa &= 0xDF; //Configure Pin 2 as output; (TRISA5 to 0)
-
-			//Pin 3 - "HostInput" (an output from uP). Make sure it is low
-			SetHIto(1); //Setting to 1 puts output low
-
-			//Pin 4 - _MCLR. A necessary input
-	
-			//Pin 5 - Rx 
-			//Do nothing for now
-
-			//Pin 6 - Tx. (C4). Configure as a low digital output
-			portc &= 0xEF; //Set Pin 6 (C4) low 
-			trisc &= 0xEF; //Set Pin 6 (C4) to output; (TRISC4 = 0)
+			TraceStop(); //The session is over
 
-			//Disable UART
-			txsta &= 0xDF; //Clear TXEN (bit 5) 
-			rcsta &= 0x6F; //Clear CREN (bit4) and SPEN (7)
-
-			//Pin 7 - Select. Already a digital output. Set to 0.
-			portc &= 0xF7;  //Set C3 (Pin 7) to 0
-
-			//Pin 8 - Already an output (low). Its turning secondary power off
-
-			//Pin 9 - DR.
-			// Do nothing for now
-
-			//Pin 10 - LED output. Set low.
-			TurnLEDoff(); 
-
-			//Pin 11 (RA2) - READ_BEGUN. A necessary input
-
-			//Pin 12 - (RA1) ICSP Clk. Set as low digital output
-			porta &= 0xFD; //Set A1 to 0
-			trisa &= 0xFD; //Configure A1 as output; (TRISA1 to 0)
-
-			//Pin 13 - ICSP Data (RA0). Set as low digital output
-			porta &= 0xFE; //Set A0 to 0
-			trisa &= 0xFE; //Configure A0 as output; (TRISA0 to 0)
+			TurnSecondaryPowerOff();
 
-			//Pin 14 - Vss. Do nothing
-			//----------------
+			SuspendForSleep(); //Pins and UART for low power
 
 
 			//Sleep until BCR button input. Decide what to do. 
@@ -1583,51 +4296,68 @@ void main(void) {
 		
 				EnableBcrButtonInterrupt();
 				TurnOffWDT();
+				if (DupCacheExpire()!=0) { //Keep coarse_s going while scans are remembered
+					wdtcon = DUP_SLEEP_WDTCON;
+				}
 
 				sleep(); //Sourceboost's PIC sleep function
 
 				DisableBcrButtonInterrupt();
+				InitWDT(); //Back to the ~34 sec period
+				if ((status & 0x10)==0) { //NOT_TO - the WDT woke us, not the button
+					coarse_s += DUP_SLEEP_SLICE_S;
+					continue;
+				}
 				clear_wdt();
 				TurnOnWDT();
+				wake_tick = timer0_isr_count;
+				first_cmd_pending = 1;
+				TraceStart();
 		
-				unsigned short down_tick, up_tick, down_time;
-				ms_delay(10); //debouncing //was 25
-				down_tick = timer0_isr_count;
-				while(BCRButtonIsDown()){ //Wait until unpressed
+				//Let the button sampler time the press (and any second press)
+				unsigned char ev = BTN_EV_NONE;
+				StartButtonSampling(&bcr_btn);
+
+				//Speculatively power up the bluetooth module and barcode reader while the press
+				//is still going on, rather than after it's been classified
+				WarmUpSecondaryPower();
+
+				ms_delay(2*BTN_DEBOUNCE_MS); //Long enough for a real press to register
+				while (ev==BTN_EV_NONE && !ButtonIdle(&bcr_btn)) {
 					clear_wdt();
-				}; 
-				up_tick = timer0_isr_count;
-
-				//Calculate down time, taking into account timer wrap
-				if (down_tick>up_tick) { //timer wrapped
-					down_time = up_tick + (MAX_U16-down_tick);
-				} 
-				else {
-					down_time = up_tick - down_tick;
+					ev = ButtonEvent(&bcr_btn);
+					if (ev==BTN_EV_HOLD) {
+						ev = BTN_EV_NONE; //Scanning; wait for the release
+					}
 				}
+				StopButtonSampling(&bcr_btn);
 	
 				//Process what the button press means.
-				//If time to short...
-				if (down_time<20) { //Was 25
-					//Don't do anything
-				}
 				//If its a quick press...
-				else if (down_time<235) { //Was 250
+				if (ev==BTN_EV_SHORT_PRESS) {
 					//Go to "RU Awake?" state
 					prev_state = current_state;
 					current_state = STATE_SENDING_RUAWAKE_OVER_BLUETOOTH;
 					break;
 				}
 				//Its time to see if a barcode got scanned!
-				else {
+				else if (ev==BTN_EV_LONG_PRESS) {
 					prev_state = current_state;
 					current_state =  STATE_GETTING_BARCODE_FROM_READER;
 					break;
 				}
+				//Deliver anything still queued, without waking the reader
+				else if (ev==BTN_EV_DOUBLE_PRESS && PendingFrames()!=0) {
+					prev_state = current_state;
+					current_state =  STATE_SENDING_BARCODE_OVER_BLUETOOTH;
+					break;
+				}
+				//Otherwise (too short), don't do anything; cancel the warm-up
+				CoolDownSecondaryPower();
 			}
 
-			//Reconfigure everything for normal use.
-			InitializeEverything(); //Re-enables BCRButton interrupt
+			//Reconfigure for normal use.
+			ResumeFromSleep(); //Re-enables BCRButton interrupt
 		}
 
 
@@ -1638,13 +4368,19 @@ void main(void) {
 
 			TurnSecondaryPowerOn();
 
-			EraseBuffer(barcode_buff, BARCODE_BUFF_LENGTH);
-			if (GetAnyBarCodes()) {
-				prev_state = current_state;
+			ArenaReleaseBarcode();
+			GetAnyBarCodes();
+			prev_state = current_state;
+
+			//If another barcode may have been scanned in the meantime, queue this one
+			//and collect that one too, so that both go out over one connection
+			if (query_bcr_f==1 && barcode_view.length!=0 && QueueHeldBarcode()) {
+				current_state = STATE_GETTING_BARCODE_FROM_READER;
+			}
+			else if (PendingFrames()!=0) {
 				current_state = STATE_SENDING_BARCODE_OVER_BLUETOOTH;
 			}
 			else {
-				prev_state = current_state;
 				current_state = STATE_ASLEEP_SECONDARY_POWER_OFF;
 			}
 		}
@@ -1653,28 +4389,29 @@ void main(void) {
 		else if (current_state==STATE_SENDING_BARCODE_OVER_BLUETOOTH) {
 			clear_wdt();
 
-		 	//If we have a valid barcode	
-			if (barcode_buff[0]!='\0') {
+		 	//If we have any barcodes to deliver
+			if (PendingFrames()!=0) {
+				unsigned short started = timer0_isr_count;
 		
 				TurnSecondaryPowerOn();
 
 				SerialSelectBlueTooth();
 
-				unsigned char res=0;
-
-				//Calculate the barcode length, clipping if need be
-				unsigned char barcode_len = strlen(barcode_buff);
-				if ( barcode_len>(BARCODE_BUFF_LENGTH-2) ) {
-					barcode_len = BARCODE_BUFF_LENGTH-2; 
-				}
-				barcode_buff[barcode_len]='\r';
+				unsigned char num_acked=0;
 
+				SessionStart(BT_SESSION_BUDGET); //Past it, give up and leave the rest queued
 				if (ConnectToRemoteBT()) {
-					res=Send( barcode_buff, barcode_len+1, "$", 1, 0, NUM_BT_SEND_TRIES, MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY);
+					num_acked = DeliverPending();
 					DisconnectFromRemoteBT();
 				}
+				SessionEnd();
+				RetirePending(num_acked); //Whatever wasn't acknowledged stays queued, if there's room
+				Checkpoint(STATE_SENDING_BARCODE_OVER_BLUETOOTH);
 
 				SerialSelectWired();
+				if ((unsigned short)(timer0_isr_count-started)>DELIVERY_LATENCY_BUDGET) {
+					slow_deliveries++;
+				}
 			}
 
 			prev_state = current_state;
@@ -1699,11 +4436,13 @@ void main(void) {
 			
 			unsigned char res=0;
 
+			SessionStart(BT_SESSION_BUDGET);
 			if (ConnectToRemoteBT()) {				
 				//Send("*", 1, NULL, 0,0, 1, 0); //A send with no reply expected
 				res=Send("*", 1, "$", 1, 0,  NUM_BT_SEND_TRIES, MAX_BT_SEND_INTER_CHAR_RESPONSE_DELAY);
 				DisconnectFromRemoteBT();
 			}
+			SessionEnd();
 
 			SerialSelectWired();
 
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+#Bar Code Reader -> Bluetooth: host-side check of the listen's reply span
+#
+#OVERVIEW
+#ListenForResponse() (../Source/main.c) cuts a reply off LISTEN_REPLY_SPAN ms after its first byte,
+#so a peer trickling bytes can't hold a listen open; RunCommand() then drains a reply that was cut
+#off with bytes still arriving (DrainRx()), so its tail doesn't land in the next command's reply.
+#This fuzzes a model of those two loops, tick by tick as the firmware runs them, with reply
+#streams like the CS-1504's (an upload of any length, at full rate or with short pauses) and with
+#trickling ones, and checks that:
+#	- a listen and its drain always end within the timing model's bound (WC_LISTEN + WC_DRAIN), and
+#	- a reply that's over within what the listen and drain can take in never spills into the next.
+#The constants are read from main.c, so the check follows them when they change; the two loops are
+#mirrored below, and have to be kept in step with the firmware's.
+#
+#USAGE
+#	listen_check.py [TRIALS [SEED]] - runs TRIALS random replies (default 20000); exits 1 on a failure
+
+import os
+import random
+import re
+import sys
+
+MAIN_C = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'Source', 'main.c')
+
+
+def read_defines(path):
+	#Object-like #defines whose values are integer expressions of each other
+	defines = {}
+	with open(path, encoding='latin-1') as f:
+		for line in f:
+			m = re.match(r'#define\s+(\w+)\s+(.+)$', line.split('//')[0].rstrip())
+			if m:
+				defines[m.group(1)] = m.group(2)
+	return defines
+
+
+def value(defines, name):
+	text = re.sub(r'\b(\d+)L\b', r'\1', defines[name]).replace('/', '//')
+	text = re.sub(r'\b([A-Za-z_]\w*)\b', lambda m: str(value(defines, m.group(1))), text)
+	return eval(text)
+
+
+class Link(object):
+	#Bytes arriving at the EUSART: times in ms from the command being sent
+
+	def __init__(self, times):
+		self.times = times
+		self.next = 0
+
+	def take(self, t):
+		#Bytes in by tick t
+		n = 0
+		while self.next < len(self.times) and self.times[self.next] <= t:
+			self.next += 1
+			n += 1
+		return n
+
+	def left(self):
+		return len(self.times) - self.next
+
+
+def listen(link, timeout, span, quiet_gap):
+	#ListenForResponse() with an unknown reply length. Returns (end tick, cut).
+	t = 0
+	li = 0
+	ri = None
+	rx_tick = None
+	while True:
+		if ri is not None and t - ri >= span:
+			return t, (t - rx_tick) < quiet_gap
+		if t - li >= timeout:
+			return t, False
+		if link.take(t):
+			if ri is None:
+				ri = t
+			rx_tick = t
+			li = t
+		t += 1
+
+
+def drain(link, t, gap, span):
+	#DrainRx(gap). Returns its end tick.
+	qi = t
+	ri = t
+	while t - qi < gap and t - ri < span + gap:
+		if link.take(t):
+			qi = t
+		t += 1
+	return t
+
+
+def stream(rng, start, length, byte_ms, max_gap):
+	times = []
+	t = start
+	for i in range(length):
+		t += byte_ms
+		if max_gap and i > 0 and rng.random() < 0.2:
+			t += rng.random() * max_gap
+		times.append(t)
+	return times
+
+
+def main(argv):
+	trials = int(argv[1]) if len(argv) > 1 else 20000
+	rng = random.Random(int(argv[2]) if len(argv) > 2 else 1)
+
+	d = read_defines(MAIN_C)
+	span = value(d, 'LISTEN_REPLY_SPAN')
+	quiet_gap = value(d, 'LISTEN_QUIET_GAP')
+	timeout = value(d, 'BCR_CMD_TIMEOUT') * 10
+	byte_ms = value(d, 'WC_BYTE_US') / 1000.0
+	bound = (timeout + span) + (timeout + span) #WC_LISTEN(timeout) + WC_DRAIN(timeout)
+	covered = 2 * span + timeout - 2 #From the first byte; the last ticks' rounding aside
+
+	failures = 0
+	longest = 0
+	for n in range(trials):
+		start = rng.random() * (timeout - byte_ms - 2) #The first byte in before the timeout
+		kind = rng.choice(('upload', 'paused', 'trickle'))
+		length = rng.randint(1, 1200)
+		if kind == 'upload':
+			times = stream(rng, start, length, byte_ms, 0)
+		elif kind == 'paused':
+			times = stream(rng, start, length, byte_ms, quiet_gap - byte_ms - 2) #Byte to byte, inside the quiet gap
+		else:
+			times = stream(rng, start, rng.randint(1, 40), byte_ms, timeout - 1)
+
+		link = Link(times)
+		end, cut = listen(link, timeout, span, quiet_gap)
+		if cut:
+			end = drain(link, end, timeout, span)
+
+		if end > start + bound + 1:
+			failures += 1
+			print('%s reply of %d bytes: over at %d ms, past the bound (%d ms)' % (kind, length, end, start + bound))
+		if kind != 'trickle' and times[-1] - times[0] <= covered:
+			if link.left():
+				failures += 1
+				print('%s reply of %d bytes (%.0f ms): %d bytes spill into the next reply' %
+					(kind, length, times[-1] - times[0], link.left()))
+			elif kind == 'upload':
+				longest = max(longest, length)
+
+	print('%d replies, %d failures; span %d ms, drain gap %d ms, bound %d ms' % (trials, failures, span, timeout, bound))
+	print('longest upload taken in whole: %d bytes' % longest)
+	return 1 if failures else 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))
@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+#Bar Code Reader -> Bluetooth: session trace replayer
+#
+#OVERVIEW
+#Reads a session trace, as the console's "dump" prints it (see Session Trace in ../Source/main.c),
+#and either lists it or replays one channel's peer against the firmware, so a real session can be
+#played back against changes to Send()/ListenForResponse().
+#
+#TRACE
+#A series of runs, read from the end backwards: <n bytes> <tag> <delta>. The tag is 0x80 if the
+#bytes were received, | 0x40 if on the bluetooth channel, | n. delta is the ms from the previous
+#run's last byte to this run's first: 0-127 as is, then (delta-126)*64 (so to within 64 ms), 255
+#meaning 8 sec or more. An empty run (0x00 0x00) starts each session. Only each run's start is
+#timed; its bytes are taken as coming back to back.
+#
+#USAGE
+#	trace_replay.py show DUMP                  - lists each session's runs: time, channel, direction,
+#	                                             bytes; and decodes the frames sent to the phone
+#	trace_replay.py serve DUMP PORT bt|wired   - plays the recorded peer of one channel on a serial
+#	                                             port (needs pyserial) wired in its place: waits for
+#	                                             each run the firmware sent (reporting any difference),
+#	                                             and sends each recorded reply at its recorded delay
+#DUMP is the console's output, saved to a file; everything up to "Trace:" is skipped.
+
+import os
+import re
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'Phone'))
+import receiver
+
+TRACE_RX = 0x80
+TRACE_BT = 0x40
+TRACE_MAX_RUN = 0x3F
+TRACE_STOPPED = 0x02
+BYTE_MS = 1.146 #An 11-bit frame at 9600
+REPLY_WAIT = 10.0 #s to wait for a run the firmware sends, when serving
+
+
+class Run(object):
+
+	def __init__(self, tag, delta, data):
+		self.rx = bool(tag & TRACE_RX)
+		self.bt = bool(tag & TRACE_BT)
+		self.delta = delta
+		self.data = data
+		self.start = 0.0 #ms from the session's start
+
+	def end(self):
+		return self.start + max(len(self.data) - 1, 0) * BYTE_MS
+
+
+def delta_ms(code):
+	if code < 128:
+		return code
+	return (code - 126) * 64
+
+
+def read_dump(path):
+	#Returns (trace bytes, state)
+	with open(path, 'rb') as f:
+		text = f.read().decode('latin-1')
+	m = re.search(r'Trace: 0x([0-9A-Fa-f]+) 0x([0-9A-Fa-f]+)', text)
+	if not m:
+		raise ValueError('no "Trace:" line')
+	length = int(m.group(1), 16)
+	state = int(m.group(2), 16)
+	digits = ''
+	for line in text[m.end():].splitlines():
+		line = line.strip()
+		if not re.match(r'^[0-9A-Fa-f]*$', line):
+			break
+		digits += line
+	data = bytes(bytearray(int(digits[i:i + 2], 16) for i in range(0, len(digits) - 1, 2)))
+	if len(data) < length:
+		raise ValueError('%d bytes of trace, not %d' % (len(data), length))
+	return data[:length], state
+
+
+def sessions(data):
+	#Returns the sessions, each a list of runs in order
+	runs = []
+	i = len(data)
+	while i >= 2:
+		tag = data[i - 2]
+		delta = data[i - 1]
+		n = tag & TRACE_MAX_RUN
+		if n > i - 2:
+			raise ValueError('a run of %d bytes ends at %d' % (n, i))
+		runs.append(Run(tag, delta, data[i - 2 - n:i - 2]))
+		i -= 2 + n
+	if i != 0:
+		raise ValueError('%d bytes before the first run' % i)
+	runs.reverse()
+
+	result = []
+	for run in runs:
+		if not run.data:
+			result.append([]) #Session start
+			continue
+		if not result:
+			raise ValueError('runs before the first session start')
+		s = result[-1]
+		prev_end = s[-1].end() if s else 0.0
+		run.start = prev_end + delta_ms(run.delta)
+		s.append(run)
+	return result
+
+
+def show(data, state):
+	print('%d bytes%s' % (len(data), ', stopped (full, or a burst outran the stage)' if state == TRACE_STOPPED else ''))
+	for k, s in enumerate(sessions(data)):
+		print('session %d' % (k + 1))
+		delivered = []
+		phone = receiver.Receiver(lambda seq, payload: delivered.append((seq, payload)))
+		for run in s:
+			print('%9.0f ms %s %s%s %s' % (run.start, 'bt   ' if run.bt else 'wired',
+				'<-' if run.rx else '->', '~' if run.delta == 255 else ' ', receiver.hex_bytes(run.data)))
+			if run.bt and not run.rx:
+				phone.feed(run.data)
+		for seq, payload in delivered:
+			print('  sent to the phone: %s' % receiver.describe(seq, payload))
+
+
+def serve(data, port_name, bt):
+	import serial
+	parity = serial.PARITY_NONE if bt else serial.PARITY_ODD
+	port = serial.Serial(port_name, 9600, parity=parity, timeout=0.05)
+	for k, s in enumerate(sessions(data)):
+		print('session %d: waiting for the firmware' % (k + 1))
+		mark = None #Host time, and trace time, of the last run the firmware sent
+		for run in s:
+			if run.bt != bt:
+				continue
+			if run.rx:
+				if mark is not None:
+					wait = (run.start - mark[1]) / 1000.0 - (time.time() - mark[0])
+					if wait > 0:
+						time.sleep(wait)
+				port.write(run.data)
+				continue
+			got = bytearray()
+			deadline = time.time() + REPLY_WAIT
+			while len(got) < len(run.data) and time.time() < deadline:
+				got += port.read(len(run.data) - len(got))
+			mark = (time.time(), run.end())
+			if bytes(got) != run.data:
+				print('  expected %s' % receiver.hex_bytes(run.data))
+				print('  got      %s' % receiver.hex_bytes(got))
+		sys.stdout.flush()
+
+
+def main(argv):
+	if len(argv) < 3 or argv[1] not in ('show', 'serve') or (argv[1] == 'serve' and
+		(len(argv) < 5 or argv[4] not in ('bt', 'wired'))):
+		sys.stderr.write('usage: trace_replay.py show DUMP | serve DUMP PORT bt|wired\n')
+		return 2
+	data, state = read_dump(argv[2])
+	if argv[1] == 'show':
+		show(data, state)
+	else:
+		serve(data, argv[3], argv[4] == 'bt')
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))